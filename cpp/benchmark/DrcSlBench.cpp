@@ -0,0 +1,454 @@
+//  This file is part of KLayoutPhotonicPCells, an extension for Photonic Layouts in KLayout.
+//  Copyright (c) 2018, Sebastian Goeldi
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+//  Micro-benchmark of the phases of DrcSl on synthetic photonic layouts. Each layout is filled with one kind of
+//  structure (or a mix of all of them) and cleaned with a sweep of database units, bounding boxes and rules. The time
+//  and the peak memory of every phase are reported on their own, see usage() for the options.
+
+#include "DrcSl.h"
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <functional>
+#include <random>
+
+using namespace drclean;
+
+//  Closed contour of points x, y in database units. Outer contours run clockwise and holes counter-clockwise like the
+//  polygons KLayout hands to the cleaner.
+typedef std::vector<std::pair<int,int>> Contour;
+
+//  Parameters of one layout of the sweep.
+struct Scenario
+{
+    std::string geometry;
+    //  Micrometers per database unit.
+    double dbu;
+    //  Side of the square bounding box in micrometers.
+    double size;
+    //  Minimum width and space in micrometers.
+    double width;
+    double space;
+};
+
+//  Time and peak memory of one phase, the best of all repetitions.
+struct PhaseResult
+{
+    const char *name;
+    double ms;
+    double peak_mb;
+    //  Peak less the resident memory at the start of the phase.
+    double growth_mb;
+};
+
+//    Set the peak resident memory of the process back to the current one. Returns false if the kernel does not
+//    allow it, then the peaks are those of the whole run.
+static bool reset_peak()
+{
+    std::ofstream f("/proc/self/clear_refs");
+    f << "5";
+    return (bool)f.flush();
+}
+
+//    Field of /proc/self/status in MiB, e.g. "VmHWM:" for the peak and "VmRSS:" for the current resident memory.
+static double status_mb(const char *field)
+{
+    std::ifstream f("/proc/self/status");
+    std::string line;
+    size_t n = std::strlen(field);
+    while(std::getline(f,line))
+    {
+        if(line.compare(0,n,field) == 0)
+            return std::atof(line.c_str() + n) / 1024.0;
+    }
+    return 0;
+}
+
+//    Builds the contours of the structures in database units. All sizes are given in micrometers.
+class LayoutBuilder
+{
+public:
+    LayoutBuilder(double dbu): dbu(dbu) {}
+
+    std::vector<Contour> contours;
+
+    int du(double um)
+    {
+        return (int)std::lround(um / this->dbu);
+    }
+
+    //    Rectangle x1, y1, x2, y2 in micrometers.
+    void rect(double x1, double y1, double x2, double y2)
+    {
+        this->contours.push_back(Contour{{du(x1),du(y1)},{du(x1),du(y2)},{du(x2),du(y2)},{du(x2),du(y1)}});
+    }
+
+    //    Circle around cx, cy, clockwise unless hole is set.
+    void circle(double cx, double cy, double r, int n, bool hole)
+    {
+        Contour c;
+        for(int k = 0; k < n; k++)
+        {
+            double a = 2 * M_PI * k / n * (hole ? 1 : -1);
+            c.emplace_back(du(cx + r * std::cos(a)),du(cy + r * std::sin(a)));
+        }
+        this->contours.push_back(c);
+    }
+
+    //    Sector of an annulus between the radii r1 and r2 and the angles a1 and a2 in radians.
+    void arc(double cx, double cy, double r1, double r2, double a1, double a2, int n)
+    {
+        Contour c;
+        for(int k = 0; k <= n; k++)
+        {
+            double a = a1 + (a2 - a1) * k / n;
+            c.emplace_back(du(cx + r1 * std::cos(a)),du(cy + r1 * std::sin(a)));
+        }
+        for(int k = n; k >= 0; k--)
+        {
+            double a = a1 + (a2 - a1) * k / n;
+            c.emplace_back(du(cx + r2 * std::cos(a)),du(cy + r2 * std::sin(a)));
+        }
+        std::reverse(c.begin(),c.end());
+        this->contours.push_back(c);
+    }
+
+    //    Straight waveguides of 0.5 um in a cell of w x h, some of them closer than the space rule.
+    void waveguides(double x, double y, double w, double h, std::mt19937 &rng)
+    {
+        std::uniform_real_distribution<double> gap(0.05,0.6);
+        for(double yy = y + 0.1; yy + 0.5 < y + h - 0.1; yy += 0.5 + gap(rng))
+            rect(x + 0.1,yy,x + w - 0.1,yy + 0.5);
+    }
+
+    //    Ring resonator with its bus waveguide 0.1 um to 0.3 um apart.
+    void ring(double x, double y, double w, double h, std::mt19937 &rng)
+    {
+        std::uniform_real_distribution<double> gap(0.1,0.3);
+        double r = std::min(w,h) / 2 - 1.5;
+        if(r < 1)
+            return;
+        double cx = x + w / 2;
+        double cy = y + h / 2 + 0.5;
+        int n = std::max(64,std::min(512,(int)(2 * M_PI * r / 0.05)));
+        circle(cx,cy,r + 0.25,n,false);
+        circle(cx,cy,r - 0.25,n,true);
+        double yb = cy - r - 0.25 - gap(rng);
+        rect(x + 0.1,yb - 0.5,x + w - 0.1,yb);
+    }
+
+    //    Linear taper from a 0.5 um waveguide to 3 um.
+    void taper(double x, double y, double w, double h, std::mt19937 &)
+    {
+        double cy = y + h / 2;
+        double wide = std::min(3.0,h - 0.2);
+        this->contours.push_back(Contour{{du(x + 0.1),du(cy - 0.25)},{du(x + 0.1),du(cy + 0.25)},
+                                         {du(x + w - 0.1),du(cy + wide / 2)},{du(x + w - 0.1),du(cy - wide / 2)}});
+    }
+
+    //    Focusing grating coupler: a wedge feeding 20 teeth of a period of 0.63 um and a fill factor of one half.
+    void grating(double x, double y, double w, double h, std::mt19937 &rng)
+    {
+        std::uniform_real_distribution<double> fill(0.4,0.6);
+        double a = 0.35;
+        double r0 = std::max(1.0,w - 0.2 - 20 * 0.63);
+        r0 = std::min(r0,(h / 2 - 0.2) / std::sin(a) - 20 * 0.63);
+        if(r0 < 1)
+            return;
+        double cx = x + 0.1;
+        double cy = y + h / 2;
+        arc(cx,cy,0,r0,-a,a,32);
+        for(int k = 0; k < 20; k++)
+        {
+            double r1 = r0 + 0.63 * k + 0.2;
+            arc(cx,cy,r1,r1 + 0.63 * fill(rng),-a,a,32);
+        }
+    }
+
+    //    Photonic crystal slab with a triangular lattice of holes with a period of 0.42 um.
+    void crystal(double x, double y, double w, double h, std::mt19937 &rng)
+    {
+        std::uniform_real_distribution<double> radius(0.1,0.14);
+        rect(x + 0.1,y + 0.1,x + w - 0.1,y + h - 0.1);
+        double p = 0.42;
+        int row = 0;
+        for(double yy = y + 0.5; yy < y + h - 0.5; yy += p * std::sqrt(3) / 2, row++)
+        {
+            for(double xx = x + 0.5 + (row % 2) * p / 2; xx < x + w - 0.5; xx += p)
+                circle(xx,yy,radius(rng),16,true);
+        }
+    }
+
+    //    Fill a square of size um with cells of the structure geometry, "mixed" cycles through all of them.
+    void fill(const std::string &geometry, double size, std::mt19937 &rng)
+    {
+        static const char *const kinds[] = {"waveguide","ring","taper","grating","crystal"};
+        double cell = geometry == "crystal" ? 10 : 25;
+        int i = 0;
+        for(double y = 0; y + cell <= size; y += cell)
+        {
+            for(double x = 0; x + cell <= size; x += cell, i++)
+            {
+                std::string kind = geometry == "mixed" ? kinds[i % 5] : geometry;
+                double c = kind == "crystal" ? 10 : cell;
+                if(kind == "waveguide")
+                    waveguides(x,y,cell,cell,rng);
+                else if(kind == "ring")
+                    ring(x,y,cell,cell,rng);
+                else if(kind == "taper")
+                    taper(x,y,cell,cell,rng);
+                else if(kind == "grating")
+                    grating(x,y,cell,cell,rng);
+                else if(kind == "crystal")
+                    crystal(x,y,c,c,rng);
+                else
+                    throw std::invalid_argument("unknown geometry " + kind);
+            }
+        }
+    }
+
+    //    Edges x1, x2, y1, y2 of all contours in the layout of DrcSl::add_data().
+    std::vector<int> edges()
+    {
+        std::vector<int> e;
+        for(const Contour &c: this->contours)
+        {
+            for(size_t i = 0; i < c.size(); i++)
+            {
+                const std::pair<int,int> &p = c[i];
+                const std::pair<int,int> &q = c[(i + 1) % c.size()];
+                e.insert(e.end(),{p.first,q.first,p.second,q.second});
+            }
+        }
+        return e;
+    }
+
+private:
+    double dbu;
+};
+
+//    Run fn with the peak memory reset before and return its time in ms and peak resident memory in MiB.
+static PhaseResult measure(const char *name, const std::function<void()> &fn)
+{
+    reset_peak();
+    double rss = status_mb("VmRSS:");
+    auto t0 = std::chrono::steady_clock::now();
+    fn();
+    auto t1 = std::chrono::steady_clock::now();
+    PhaseResult r;
+    r.name = name;
+    r.ms = std::chrono::duration<double,std::milli>(t1 - t0).count();
+    r.peak_mb = status_mb("VmHWM:");
+    r.growth_mb = std::max(0.0,r.peak_mb - rss);
+    return r;
+}
+
+//    Clean the layout of s once and time each phase. clean() is run on a copy of the sorted cleaner, so that
+//    switch_dimensions() is timed on the same data as clean().
+static std::vector<PhaseResult> run_once(const Scenario &s, const std::vector<int> &edges, int nthreads,
+                                         size_t &npolygons)
+{
+    std::vector<PhaseResult> res;
+    int size = (int)std::lround(s.size / s.dbu);
+    int width = std::max(1,(int)std::lround(s.width / s.dbu));
+    int space = std::max(1,(int)std::lround(s.space / s.dbu));
+
+    DrcSl sl;
+    sl.initialize_list(0,size,0,size,space,width);
+    if(nthreads > 1)
+        sl.set_threads(nthreads);
+    res.push_back(measure("add_data",[&sl,&edges]()
+    {
+        for(size_t i = 0; i < edges.size(); i += 4)
+            sl.add_data(edges[i],edges[i+1],edges[i+2],edges[i+3]);
+    }));
+    res.push_back(measure("sortlist",[&sl]()
+    {
+        sl.sortlist();
+    }));
+
+    DrcSl sw(sl);
+    res.push_back(measure("switch_dimensions",[&sw]()
+    {
+        sw.switch_dimensions();
+    }));
+
+    res.push_back(measure("clean",[&sl]()
+    {
+        sl.clean();
+    }));
+    res.push_back(measure("get_polygons",[&sl,&npolygons]()
+    {
+        npolygons = sl.get_polygons().size();
+    }));
+    return res;
+}
+
+static void usage()
+{
+    std::printf("Usage: drcsl_bench [options]\n"
+                "  --geometry NAME   waveguide, ring, taper, grating, crystal, mixed or all (default all)\n"
+                "  --dbu LIST        database units in um, comma separated (default 0.001,0.005)\n"
+                "  --size LIST       sides of the bounding box in um (default 100,400)\n"
+                "  --rules LIST      width:space pairs in um (default 0.15:0.15,0.3:0.2)\n"
+                "  --reps N          repetitions, the best one is reported (default 3)\n"
+                "  --threads N       threads of the cleaner (default 1)\n"
+                "  --quick           one small layout per geometry\n"
+                "  --csv             comma separated output\n");
+}
+
+//    Values of a comma separated list.
+static std::vector<std::string> split(const std::string &s)
+{
+    std::vector<std::string> v;
+    size_t a = 0;
+    while(a <= s.size())
+    {
+        size_t b = s.find(',',a);
+        if(b == std::string::npos)
+            b = s.size();
+        if(b > a)
+            v.push_back(s.substr(a,b - a));
+        a = b + 1;
+    }
+    return v;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::string> geometries{"waveguide","ring","taper","grating","crystal","mixed"};
+    std::vector<double> dbus{0.001,0.005};
+    std::vector<double> sizes{100,400};
+    std::vector<std::pair<double,double>> rules{{0.15,0.15},{0.3,0.2}};
+    int reps = 3;
+    int nthreads = 1;
+    bool csv = false;
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        bool has_value = i + 1 < argc;
+        if(a == "--geometry" && has_value)
+        {
+            std::string g = argv[++i];
+            if(g != "all")
+                geometries = split(g);
+        }
+        else if(a == "--dbu" && has_value)
+        {
+            dbus.clear();
+            for(const std::string &v: split(argv[++i]))
+                dbus.push_back(std::stod(v));
+        }
+        else if(a == "--size" && has_value)
+        {
+            sizes.clear();
+            for(const std::string &v: split(argv[++i]))
+                sizes.push_back(std::stod(v));
+        }
+        else if(a == "--rules" && has_value)
+        {
+            rules.clear();
+            for(const std::string &v: split(argv[++i]))
+            {
+                size_t c = v.find(':');
+                double w = std::stod(v.substr(0,c));
+                rules.emplace_back(w,c == std::string::npos ? w : std::stod(v.substr(c + 1)));
+            }
+        }
+        else if(a == "--reps" && has_value)
+            reps = std::max(1,std::atoi(argv[++i]));
+        else if(a == "--threads" && has_value)
+            nthreads = std::max(1,std::atoi(argv[++i]));
+        else if(a == "--quick")
+        {
+            dbus = {0.005};
+            sizes = {100};
+            rules = {{0.15,0.15}};
+            reps = 1;
+        }
+        else if(a == "--csv")
+            csv = true;
+        else
+        {
+            usage();
+            return a == "--help" ? 0 : 1;
+        }
+    }
+
+    if(!reset_peak())
+        std::fprintf(stderr,"The peak memory can not be reset, the peaks are those of the whole run.\n");
+
+    if(csv)
+        std::printf("geometry,dbu_um,size_um,width_um,space_um,edges,polygons,phase,ms,peak_mb,growth_mb\n");
+    else
+        std::printf("%-10s %7s %7s %11s %9s %9s  %-18s %10s %9s %9s\n","geometry","dbu","size","width/space",
+                    "edges","polygons","phase","ms","peak MiB","grow MiB");
+
+    for(const std::string &geometry: geometries)
+    {
+        for(double dbu: dbus)
+        {
+            for(double size: sizes)
+            {
+                // The same layout for all rules, so the rules are the only difference.
+                std::mt19937 rng(1);
+                LayoutBuilder builder(dbu);
+                builder.fill(geometry,size,rng);
+                std::vector<int> edges = builder.edges();
+                std::vector<Contour>().swap(builder.contours);
+
+                for(const std::pair<double,double> &rule: rules)
+                {
+                    Scenario s{geometry,dbu,size,rule.first,rule.second};
+                    std::vector<PhaseResult> best;
+                    size_t npolygons = 0;
+                    for(int r = 0; r < reps; r++)
+                    {
+                        std::vector<PhaseResult> res = run_once(s,edges,nthreads,npolygons);
+                        if(best.empty())
+                            best = res;
+                        for(size_t p = 0; p < res.size(); p++)
+                        {
+                            best[p].ms = std::min(best[p].ms,res[p].ms);
+                            best[p].peak_mb = std::min(best[p].peak_mb,res[p].peak_mb);
+                            best[p].growth_mb = std::min(best[p].growth_mb,res[p].growth_mb);
+                        }
+                    }
+                    for(const PhaseResult &p: best)
+                    {
+                        if(csv)
+                            std::printf("%s,%g,%g,%g,%g,%zu,%zu,%s,%.3f,%.1f,%.1f\n",geometry.c_str(),dbu,size,
+                                        s.width,s.space,edges.size() / 4,npolygons,p.name,p.ms,p.peak_mb,p.growth_mb);
+                        else
+                            std::printf("%-10s %7g %7g %5g/%-5g %9zu %9zu  %-18s %10.3f %9.1f %9.1f\n",geometry.c_str(),
+                                        dbu,size,s.width,s.space,edges.size() / 4,npolygons,p.name,p.ms,p.peak_mb,
+                                        p.growth_mb);
+                    }
+                    std::fflush(stdout);
+                }
+            }
+        }
+    }
+    return 0;
+}
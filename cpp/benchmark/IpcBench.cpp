@@ -0,0 +1,334 @@
+//  This file is part of KLayoutPhotonicPCells, an extension for Photonic Layouts in KLayout.
+//  Copyright (c) 2018, Sebastian Goeldi
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+//  End to end benchmark of the cleaner process. The benchmark takes the place of KLayout: it creates a CleanerMaster,
+//  starts a real cleanermain for it and submits layers of rectangles, keeping up to a window of them in flight. It
+//  reports the latency from submitting a layer to reading its last part and the layers per second. Each workload is
+//  run once with cleaning and once with cleanermain --passthrough, which returns the layers without cleaning them, so
+//  the cost of the shared memory protocol can be told apart from the one of the cleaning. See usage() for the options.
+
+#include "CleanerMaster.h"
+
+#include <vector>
+#include <string>
+#include <map>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <sys/wait.h>
+
+using namespace drclean;
+
+typedef std::chrono::steady_clock Clock;
+
+//  Options of the benchmark.
+struct Options
+{
+    std::string cleanermain;
+    int layers = 200;
+    std::vector<int> edges{1000,10000,50000};
+    int window = 4;
+    int slots = 16;
+    int threads = 1;
+    //  Read the results with next_result() like kppc.drc, or with get_polygons().
+    bool polygons = false;
+    std::vector<bool> passthrough{false,true};
+    bool csv = false;
+};
+
+//  Latencies of one workload.
+struct RunResult
+{
+    double seconds;
+    //  Time spent in set_box(), add_edges() and done() per layer.
+    double submit_ms;
+    std::vector<double> latency_ms;
+};
+
+//    Edges of a layer of nedges / 2 rectangles like waveguides: 500 wide, between 1000 and 5000 long and 50 to 600
+//    apart, in rows in a square box. Each rectangle is a left edge upwards and a right edge downwards. Returns the box
+//    x1, x2, y1, y2.
+static std::vector<int> make_layer(int nedges, unsigned seed, std::vector<int> &edges)
+{
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> length(1000,5000);
+    std::uniform_int_distribution<int> gap(50,600);
+    int nrects = std::max(1,nedges / 2);
+    //  The rows are about as long as the box is high.
+    int side = (int)std::sqrt((double)nrects * 3325 * 825) + 5000;
+    edges.clear();
+    int x = 0;
+    int y = 0;
+    for(int i = 0; i < nrects; i++)
+    {
+        int l = length(rng);
+        if(x + l > side)
+        {
+            x = 0;
+            y += 500 + gap(rng);
+        }
+        edges.insert(edges.end(),{x,x,y,y + 500,x + l,x + l,y + 500,y});
+        x += l + gap(rng);
+    }
+    return std::vector<int>{-1000,side + 1000,-1000,std::max(side,y + 500) + 1000};
+}
+
+//    Start cleanermain for the engine name and return its process id, or -1 if it could not be started.
+static pid_t start_cleaner(const Options &opt, const std::string &name, bool passthrough)
+{
+    std::vector<std::string> args{opt.cleanermain};
+    if(passthrough)
+        args.push_back("--passthrough");
+    args.push_back(std::to_string(opt.threads));
+    args.push_back(name);
+    // Without a cache, so the repeated layers are cleaned each time.
+    args.push_back("0");
+    std::vector<char*> argv;
+    for(std::string &a: args)
+        argv.push_back(&a[0]);
+    argv.push_back(nullptr);
+
+    std::fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        // cleanermain reports on stdout, which would be mixed into the table.
+        if(!std::freopen("/dev/null","w",stdout))
+            _exit(127);
+        execv(argv[0],argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+//    Whether the cleanermain process pid still runs and checks in with the master.
+static bool cleaner_running(CleanerMaster &cm, pid_t pid)
+{
+    int wstatus;
+    return waitpid(pid,&wstatus,WNOHANG) == 0 && cm.alive(1000);
+}
+
+//    Submit opt.layers layers with nedges edges each and read their results. Up to opt.window layers are submitted
+//    but not completely read at any time.
+static bool run_workload(const Options &opt, int nedges, bool passthrough, RunResult &res)
+{
+    // A few different layers, so consecutive layers differ.
+    std::vector<std::vector<int>> layers(4);
+    std::vector<std::vector<int>> boxes(4);
+    for(size_t i = 0; i < layers.size(); i++)
+        boxes[i] = make_layer(nedges,i + 1,layers[i]);
+
+    std::string name = "DrcBench" + std::to_string(getpid());
+    CleanerMaster cm(opt.slots,name);
+    pid_t pid = start_cleaner(opt,name,passthrough);
+    if(pid < 0 || !cm.wait_ready(10000))
+    {
+        std::fprintf(stderr,"%s did not start\n",opt.cleanermain.c_str());
+        if(pid > 0)
+        {
+            kill(pid,SIGKILL);
+            waitpid(pid,nullptr,0);
+        }
+        return false;
+    }
+
+    std::vector<Clock::time_point> submitted(opt.layers);
+    //  Parts still to be read by layer, known once the first part is read.
+    std::map<int,int> remaining;
+    res.latency_ms.clear();
+    double submit = 0;
+    int nsubmitted = 0;
+    int ncompleted = 0;
+    bool ok = true;
+
+    Clock::time_point t0 = Clock::now();
+    while(ncompleted < opt.layers && ok)
+    {
+        while(nsubmitted < opt.layers && nsubmitted - ncompleted < opt.window)
+        {
+            const std::vector<int> &box = boxes[nsubmitted % boxes.size()];
+            const std::vector<int> &edges = layers[nsubmitted % layers.size()];
+            Clock::time_point ts = Clock::now();
+            cm.set_box(nsubmitted,0,150,150,box[0],box[1],box[2],box[3]);
+            cm.add_edges(edges.data(),edges.size() / 4);
+            while(cm.done(1000))
+            {
+                if(!cleaner_running(cm,pid))
+                {
+                    ok = false;
+                    break;
+                }
+            }
+            submitted[nsubmitted++] = ts;
+            submit += std::chrono::duration<double,std::milli>(Clock::now() - ts).count();
+        }
+
+        int layer;
+        int nparts = 1;
+        if(opt.polygons)
+        {
+            std::vector<std::vector<pi>> polys = cm.get_polygons(1000);
+            layer = polys[0][0].first;
+            if(layer >= 0)
+                nparts = polys[0][2].second;
+        }
+        else
+        {
+            LayerResult r;
+            layer = -1;
+            if(cm.next_result(1000,r))
+            {
+                layer = r.layer;
+                nparts = r.nparts;
+                cm.release(r.ticket,r.part);
+            }
+        }
+        if(layer < 0)
+        {
+            ok = cleaner_running(cm,pid);
+            continue;
+        }
+        std::map<int,int>::iterator it = remaining.emplace(layer,nparts).first;
+        if(--it->second == 0)
+        {
+            remaining.erase(it);
+            ncompleted++;
+            res.latency_ms.push_back(std::chrono::duration<double,std::milli>(Clock::now() - submitted[layer]).count());
+        }
+    }
+    res.seconds = std::chrono::duration<double>(Clock::now() - t0).count();
+    res.submit_ms = nsubmitted ? submit / nsubmitted : 0;
+
+    cm.shutdown();
+    if(!ok)
+    {
+        std::fprintf(stderr,"cleanermain stopped after %d of %d layers\n",ncompleted,opt.layers);
+        kill(pid,SIGKILL);
+    }
+    waitpid(pid,nullptr,0);
+    return ok;
+}
+
+//    Percentile p of the sorted values v, with linear interpolation.
+static double percentile(const std::vector<double> &v, double p)
+{
+    if(v.empty())
+        return 0;
+    double r = p / 100 * (v.size() - 1);
+    size_t i = (size_t)r;
+    if(i + 1 >= v.size())
+        return v.back();
+    return v[i] + (r - i) * (v[i + 1] - v[i]);
+}
+
+static void usage()
+{
+    std::printf("Usage: ipc_bench [options]\n"
+                "  --cleanermain PATH  cleanermain to run (default: next to ipc_bench)\n"
+                "  --layers N          layers per workload (default 200)\n"
+                "  --edges LIST        edges per layer, comma separated (default 1000,10000,50000)\n"
+                "  --window N          layers in flight (default 4), 1 measures the latency of single layers\n"
+                "  --slots N           slots of the queue of the master (default 16)\n"
+                "  --threads N         threads of cleanermain (default 1)\n"
+                "  --read MODE         result (default, like kppc.drc) or polygons\n"
+                "  --mode MODE         clean, passthrough or both (default both)\n"
+                "  --csv               comma separated output\n");
+}
+
+int main(int argc, char* argv[])
+{
+    Options opt;
+    std::string self = argv[0];
+    size_t slash = self.rfind('/');
+    opt.cleanermain = (slash == std::string::npos ? std::string(".") : self.substr(0,slash)) + "/cleanermain";
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string a = argv[i];
+        bool has_value = i + 1 < argc;
+        if(a == "--cleanermain" && has_value)
+            opt.cleanermain = argv[++i];
+        else if(a == "--layers" && has_value)
+            opt.layers = std::max(1,std::atoi(argv[++i]));
+        else if(a == "--edges" && has_value)
+        {
+            opt.edges.clear();
+            std::string s = argv[++i];
+            size_t p = 0;
+            while(p < s.size())
+            {
+                opt.edges.push_back(std::max(2,std::atoi(s.c_str() + p)));
+                p = s.find(',',p);
+                p = p == std::string::npos ? s.size() : p + 1;
+            }
+        }
+        else if(a == "--window" && has_value)
+            opt.window = std::max(1,std::atoi(argv[++i]));
+        else if(a == "--slots" && has_value)
+            opt.slots = std::max(1,std::atoi(argv[++i]));
+        else if(a == "--threads" && has_value)
+            opt.threads = std::max(1,std::atoi(argv[++i]));
+        else if(a == "--read" && has_value)
+            opt.polygons = std::string(argv[++i]) == "polygons";
+        else if(a == "--mode" && has_value)
+        {
+            std::string m = argv[++i];
+            if(m == "clean")
+                opt.passthrough = {false};
+            else if(m == "passthrough")
+                opt.passthrough = {true};
+        }
+        else if(a == "--csv")
+            opt.csv = true;
+        else
+        {
+            usage();
+            return a == "--help" ? 0 : 1;
+        }
+    }
+
+    if(opt.csv)
+        std::printf("mode,edges,layers,window,seconds,layers_per_s,submit_ms,p50_ms,p90_ms,p99_ms,max_ms\n");
+    else
+        std::printf("%-12s %8s %7s %6s %9s %10s %10s %9s %9s %9s %9s\n","mode","edges","layers","window","s",
+                    "layers/s","submit ms","p50 ms","p90 ms","p99 ms","max ms");
+
+    for(int nedges: opt.edges)
+    {
+        for(bool passthrough: opt.passthrough)
+        {
+            RunResult r;
+            if(!run_workload(opt,nedges,passthrough,r))
+                return 1;
+            std::sort(r.latency_ms.begin(),r.latency_ms.end());
+            const char *mode = passthrough ? "passthrough" : "clean";
+            if(opt.csv)
+                std::printf("%s,%d,%d,%d,%.3f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f\n",mode,nedges,opt.layers,opt.window,
+                            r.seconds,opt.layers / r.seconds,r.submit_ms,percentile(r.latency_ms,50),
+                            percentile(r.latency_ms,90),percentile(r.latency_ms,99),r.latency_ms.back());
+            else
+                std::printf("%-12s %8d %7d %6d %9.3f %10.1f %10.3f %9.3f %9.3f %9.3f %9.3f\n",mode,nedges,opt.layers,
+                            opt.window,r.seconds,opt.layers / r.seconds,r.submit_ms,percentile(r.latency_ms,50),
+                            percentile(r.latency_ms,90),percentile(r.latency_ms,99),r.latency_ms.back());
+            std::fflush(stdout);
+        }
+    }
+    return 0;
+}
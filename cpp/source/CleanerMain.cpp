@@ -16,15 +16,33 @@
 
 #include "CleanerSlave.h"
 #include <string>
+#include <vector>
+#include <algorithm>
 
+//    Usage: cleanermain [--passthrough] [nthreads [name [cache_mb [cache_dir]]]]
+//    name is the name of the engine the master was created with, by default DRCleanEngine. cache_mb is the memory for
+//    the cache of cleaned layers in MiB and cache_dir a directory which keeps them across sessions. With --passthrough
+//    the layers are returned without cleaning them, which is used to benchmark the shared memory protocol.
 int main(int argc, char* argv[])
 {
+    std::vector<std::string> args;
+    bool passthrough = false;
+    for(int i = 1; i < argc; i++)
+    {
+        if(std::string(argv[i]) == "--passthrough")
+            passthrough = true;
+        else
+            args.push_back(argv[i]);
+    }
+
     drclean::CleanerSlave* cs;
-    if(argc < 2)
+    if(args.empty())
     {
         cs = new drclean::CleanerSlave();
-    } else if(argc == 2) {
-        cs = new drclean::CleanerSlave(std::stoi(argv[1]));
+    } else if(args.size() == 1) {
+        cs = new drclean::CleanerSlave(std::stoi(args[0]));
+    } else {
+        cs = new drclean::CleanerSlave(std::stoi(args[0]),args[1]);
     }
     
     
@@ -33,10 +51,17 @@ int main(int argc, char* argv[])
         return -1;
     }
 
+    if(args.size() > 2)
+    {
+        cs->set_cache((size_t)std::max(0,std::stoi(args[2])) << 20,args.size() > 3 ? args[3] : "");
+    }
+    cs->set_passthrough(passthrough);
+
     SignalHandler signalHandler;
     signalHandler.setSignalToHandle(SIGUSR1);
 
-    while(!signalHandler.isSignalSet())
+    // The process keeps running for many cells until it gets the signal, or the master shuts it down or exits.
+    while(!signalHandler.isSignalSet() && cs->keep_running())
     {
         cs->clean();
     }
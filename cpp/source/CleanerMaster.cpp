@@ -20,38 +20,129 @@
 namespace drclean
 {
 
-CleanerMaster::CleanerMaster()
+CleanerMaster::CleanerMaster(): CleanerMaster(default_slots)
 {
-    bi::shared_memory_object::remove("DRCleanEngine");
+}
 
-    bi::named_mutex::remove("mux_inp");
-    bi::named_mutex::remove("mux_out");
+CleanerMaster::CleanerMaster(int nslots): CleanerMaster(nslots,default_engine_name)
+{
+}
+
+//    Create the shared memory named name with a queue of nslots layer jobs for the slave. The segment only holds the
+//    queue and the list of cleaned layers, the layers themselves are passed in segments of their own. All names of the
+//    engine start with name, the slave has to be started with the same name. Leftovers of an engine with the same name
+//    which was not shut down are removed.
+CleanerMaster::CleanerMaster(int nslots, const std::string &name): segment_name(name)
+{
+    remove_shared();
 
-    segment = new bi::managed_shared_memory(bi::create_only, "DRCleanEngine", 1073741824);
+    segment = new bi::managed_shared_memory(bi::create_only, segment_name.data(), segment_size);
 
     alloc_inst = new ShmemAllocatorInt(segment->get_segment_manager());
 
-    input = segment->construct<ShIVector>("input") (*alloc_inst);
+    jobs = segment->construct<JobQueue>("jobs") (std::max(1,nslots),segment->get_segment_manager());
+    status = segment->construct<EngineStatus>("status") (getpid());
     outList = segment->construct<ShIVector>("outList") (*alloc_inst);
 
-    mux_inp = new bi::named_mutex(bi::open_or_create, "mux_inp");
-    mux_out = new bi::named_mutex(bi::open_or_create, "mux_out");
+    mux_inp = new bi::named_mutex(bi::create_only, sync_name(segment_name,"mux_inp").data());
+    mux_out = new bi::named_mutex(bi::create_only, sync_name(segment_name,"mux_out").data());
+    cv_inp = new bi::named_condition(bi::create_only, sync_name(segment_name,"cv_inp").data());
+    cv_out = new bi::named_condition(bi::create_only, sync_name(segment_name,"cv_out").data());
 
 }
 
-CleanerMaster::CleanerMaster(int nlayers)
-{
-    CleanerMaster();
-    outList->resize(nlayers);
-}
-
+//    Shut the slave down and remove the shared memory together with the segments of the layers that were queued but
+//    never read. The slave finishes the layers it is cleaning first, which the destructor waits for up to
+//    detach_timeout_ms. If the slave is still attached after that, removing the segments is left to the slave, which
+//    would otherwise write results nobody removes.
 CleanerMaster::~CleanerMaster()
 {
-    bi::shared_memory_object::remove("DRCleanEngine");
+    shutdown();
+    {
+        bi::scoped_lock<bi::named_mutex> lock(*mux_inp);
+        bool detached = cv_inp->timed_wait(lock,deadline(detach_timeout_ms),[this]()
+        {
+            return status->slave_pid == 0;
+        });
+        if(!detached)
+            status->master_gone = 1;
+    }
+    for(std::pair<const std::pair<unsigned,int>,bi::mapped_region*> &m: mapped)
+    {
+        delete m.second;
+    }
+    for(unsigned ticket: tickets)
+    {
+        bi::shared_memory_object::remove(job_name(segment_name,ticket).data());
+        for(int part = 0; part <= error_part; part++)
+        {
+            bi::shared_memory_object::remove(result_name(segment_name,ticket,part).data());
+        }
+    }
     delete segment;
     delete alloc_inst;
     delete mux_out;
     delete mux_inp;
+    delete cv_out;
+    delete cv_inp;
+    remove_shared();
+}
+
+//    Remove the segment and the named mutexes and conditions of the engine.
+void CleanerMaster::remove_shared()
+{
+    bi::shared_memory_object::remove(segment_name.data());
+    bi::named_mutex::remove(sync_name(segment_name,"mux_inp").data());
+    bi::named_mutex::remove(sync_name(segment_name,"mux_out").data());
+    bi::named_condition::remove(sync_name(segment_name,"cv_inp").data());
+    bi::named_condition::remove(sync_name(segment_name,"cv_out").data());
+}
+
+//    Name of the engine, which is passed to the slave.
+std::string CleanerMaster::name()
+{
+    return segment_name;
+}
+
+//    Wait up to timeout_ms for the slave to attach to the engine. Returns whether it is ready to clean.
+bool CleanerMaster::wait_ready(int timeout_ms)
+{
+    bi::scoped_lock<bi::named_mutex> lock(*mux_inp);
+    return cv_inp->timed_wait(lock,deadline(timeout_ms),[this]()
+    {
+        return status->slave_pid != 0;
+    });
+}
+
+//    Whether the slave is attached and was seen within the last max_age_ms. While it runs, the slave checks in at least
+//    every 30 ms, even if all of its threads are busy.
+bool CleanerMaster::alive(int max_age_ms)
+{
+    bi::scoped_lock<bi::named_mutex> lock(*mux_inp);
+    return status->slave_pid != 0 && !status->stop && now_ms() - status->heartbeat <= max_age_ms;
+}
+
+//    Ask the slave to finish the layers it is cleaning and to exit. Layers still in the queue are not cleaned.
+void CleanerMaster::shutdown()
+{
+    mux_inp->lock();
+    status->stop = 1;
+    mux_inp->unlock();
+    cv_inp->notify_all();
+}
+
+//    Number of layers the slave took from its cache.
+long long CleanerMaster::cache_hits()
+{
+    bi::scoped_lock<bi::named_mutex> lock(*mux_inp);
+    return status->cache_hits;
+}
+
+//    Number of layers the slave did not find in its cache and cleaned.
+long long CleanerMaster::cache_misses()
+{
+    bi::scoped_lock<bi::named_mutex> lock(*mux_inp);
+    return status->cache_misses;
 }
 
 int CleanerMaster::set_box(int layer, int datatype, int violation_width, int violation_space, int x1, int x2, int y1, int y2)
@@ -76,103 +167,198 @@ void CleanerMaster::add_edge(int x1, int x2, int y1, int y2)
     local_input.push_back(y2);
 }
 
-int CleanerMaster::done()
+//    Add n edges stored as x1,x2,y1,y2 one after another.
+void CleanerMaster::add_edges(const int *edges, size_t n)
 {
-    mux_inp->lock();
-    if(!input->empty())
+    local_input.insert(local_input.end(),edges,edges + 4*n);
+}
+
+//    Queue the layer of the last set_box() for the slave. If all slots of the queue are in use, wait up to timeout_ms
+//    for the slave to free one. Returns 1 if there is still no free slot, the layer has to be queued again later then.
+//    The layer is copied into a segment of its own, which is just large enough, without holding the lock of the queue.
+int CleanerMaster::done(int timeout_ms)
+{
+    int slot;
     {
-        mux_inp->unlock();
-        return 1;
+        bi::scoped_lock<bi::named_mutex> lock(*mux_inp);
+        slot = jobs->claim();
+        if(slot < 0 && timeout_ms > 0)
+        {
+            cv_inp->timed_wait(lock,deadline(timeout_ms),[this,&slot]()
+            {
+                return (slot = jobs->claim()) >= 0;
+            });
+        }
     }
+    if(slot < 0)
+        return 1;
 
-    for(auto iter = local_input.begin(); iter!=local_input.end(); iter++)
+    std::string name = job_name(segment_name,jobs->slots[slot].ticket);
+    try
     {
-        input->push_back(*iter);
+        bi::managed_shared_memory job(bi::create_only, name.data(), local_input.size() * sizeof(int) + segment_slack);
+        ShIVector* data = job.construct<ShIVector>("data") (ShmemAllocatorInt(job.get_segment_manager()));
+        data->reserve(local_input.size());
+        data->assign(local_input.begin(),local_input.end());
+    }
+    catch(...)
+    {
+        bi::shared_memory_object::remove(name.data());
+        mux_inp->lock();
+        jobs->release(slot);
+        mux_inp->unlock();
+        throw;
     }
+    tickets.insert(jobs->slots[slot].ticket);
 
+    mux_inp->lock();
+    jobs->publish(slot);
     mux_inp->unlock();
+    cv_inp->notify_all();
+    local_input.clear();
 
     return 0;
 }
 
-std::vector<std::vector<int>> CleanerMaster::get_layer()
+//    Take the next part of a cleaned layer from outList, waiting up to timeout_ms for the slave to finish one. Returns
+//    false if there is none. The part is in the segment result_name(segment_name,ticket,part).
+bool CleanerMaster::next_layer(int timeout_ms, int &layer, int &datatype, unsigned &ticket, int &part)
 {
-    std::vector<std::vector<int>> lines;
-    mux_out->lock();
-    int layer;
-    int datatype;
-    if(!outList->empty())
+    bi::scoped_lock<bi::named_mutex> lock(*mux_out);
+    if(outList->empty() && timeout_ms > 0)
     {
-        datatype = outList->back();
-        outList->pop_back();
-        layer = outList->back();
-        outList->pop_back();
-        mux_out->unlock();
+        cv_out->timed_wait(lock,deadline(timeout_ms),[this]()
+        {
+            return !outList->empty();
+        });
     }
-    else
+    if(outList->empty())
+        return false;
+    part = outList->back();
+    outList->pop_back();
+    ticket = outList->back();
+    outList->pop_back();
+    datatype = outList->back();
+    outList->pop_back();
+    layer = outList->back();
+    outList->pop_back();
+    return true;
+}
+
+//    Read the next part of a cleaned layer with one vector x0,y0,x1,y1,... per polygon after layer, datatype, part and
+//    nparts. If none is done within timeout_ms, (-1,-1) is returned as its layer. The segment of the part is removed
+//    afterwards. Throws like next_result() if the layer could not be cleaned.
+std::vector<std::vector<int>> CleanerMaster::get_layer(int timeout_ms)
+{
+    std::vector<std::vector<int>> lines;
+    LayerResult res;
+    if(!next_result(timeout_ms,res))
     {
-        mux_out->unlock();
         std::vector<int> ld(2,-1);
         lines.push_back(ld);
         return lines;
     }
-    std::vector<int> ld{layer,datatype};
+    std::vector<int> ld{res.layer,res.datatype,res.part,res.nparts};
     lines.push_back(ld);
-    std::string layername = std::to_string(layer) + "/" + std::to_string(datatype);
-    ShIVVector* linesVect = segment->find<ShIVVector>(layername.data()).first;
 
-    for(ShIVVector::iterator iter = linesVect->begin(); iter != linesVect->end(); iter++)
+    lines.reserve(res.npolygons + 1);
+    for(size_t j = 0; j < res.npolygons; j++)
     {
-        std::vector<int> poly;
-        for(ShIVector::iterator iterint = iter->begin(); iterint != iter->end(); iterint++)
-        {
-            poly.push_back(*iterint);
-        }
-        lines.push_back(std::move(poly));
-
+        lines.emplace_back(res.points + 2 * res.offsets[j],res.points + 2 * res.offsets[j+1]);
     }
+    release(res.ticket,res.part);
     return lines;
 }
 
-std::vector<std::vector<pi>> CleanerMaster::get_polygons()
+//    Map the next part of a cleaned layer, waiting up to timeout_ms for the slave to finish one. Returns false if there
+//    is none. The offsets and points of res point into the shared memory and stay valid until release() is called with
+//    its ticket and part, nothing is copied. The parts of a layer arrive in no particular order and mixed with the
+//    parts of other layers. Throws std::runtime_error if the slave could not clean the layer of the part.
+bool CleanerMaster::next_result(int timeout_ms, LayerResult &res)
 {
-    std::vector<std::vector<pi>> polys;
+    if(!next_layer(timeout_ms,res.layer,res.datatype,res.ticket,res.part))
+        return false;
+
+    std::string name = result_name(segment_name,res.ticket,res.part);
+    bi::shared_memory_object shm(bi::open_only, name.data(), bi::read_only);
+    bi::mapped_region *region = new bi::mapped_region(shm, bi::read_only);
+    const ResultHeader *header = static_cast<const ResultHeader*>(region->get_address());
+    if(header->nparts < 0)
+    {
+        // The ticket stays in tickets, so parts of the layer which were published before the error are removed
+        // together with the engine.
+        const char *text = reinterpret_cast<const char*>(header + 1);
+        std::string message(text,strnlen(text,region->get_size() - sizeof(ResultHeader)));
+        delete region;
+        bi::shared_memory_object::remove(name.data());
+        throw std::runtime_error("Cleaning layer " + std::to_string(res.layer) + "/" + std::to_string(res.datatype) +
+                                 " failed: " + message);
+    }
+    mapped[std::make_pair(res.ticket,res.part)] = region;
+    res.nparts = header->nparts;
+    res.x1 = header->x1;
+    res.y1 = header->y1;
+    res.x2 = header->x2;
+    res.y2 = header->y2;
+    if(unread.find(res.ticket) == unread.end())
+        unread[res.ticket] = header->nparts;
+    res.offsets = reinterpret_cast<const int*>(header + 1);
+    res.npolygons = header->noffsets > 0 ? header->noffsets - 1 : 0;
+    res.points = res.offsets + header->noffsets;
+    res.npoints = header->npoints;
+    return true;
+}
 
-    mux_out->lock();
-    int layer;
-    int datatype;
-    if(!outList->empty())
+//    Unmap the part with the given ticket from next_result() and remove its segment. The layer is done once all of its
+//    parts are released.
+void CleanerMaster::release(unsigned ticket, int part)
+{
+    std::map<std::pair<unsigned,int>,bi::mapped_region*>::iterator it = mapped.find(std::make_pair(ticket,part));
+    if(it == mapped.end())
+        return;
+    delete it->second;
+    mapped.erase(it);
+    bi::shared_memory_object::remove(result_name(segment_name,ticket,part).data());
+    if(--unread[ticket] == 0)
     {
-        datatype = outList->back();
-        outList->pop_back();
-        layer = outList->back();
-        outList->pop_back();
-        mux_out->unlock();
+        unread.erase(ticket);
+        tickets.erase(ticket);
     }
-    else
+}
+
+//    Read the polygons of the next part of a cleaned layer. If none is done within timeout_ms, (-1,-1) is returned as its
+//    layer. The segment of the part is removed afterwards. Throws like next_result() if the layer could not be cleaned.
+std::vector<std::vector<pi>> CleanerMaster::get_polygons(int timeout_ms)
+{
+    std::vector<std::vector<pi>> polys;
+
+    LayerResult res;
+    if(!next_result(timeout_ms,res))
     {
-        mux_out->unlock();
         std::vector<pi> ld;
         ld.push_back(std::make_pair(-1,-1));
         polys.push_back(ld);
         return polys;
     }
     std::vector<pi> ld;
-    ld.push_back(std::make_pair(layer,datatype));
+    ld.push_back(std::make_pair(res.layer,res.datatype));
+    // The polygons of the cleaner never overlap, which is flagged by (1,0) so they can be used without merging them.
+    ld.push_back(std::make_pair(1,0));
+    ld.push_back(std::make_pair(res.part,res.nparts));
     polys.push_back(ld);
-    std::string layername = std::to_string(layer) + "/" + std::to_string(datatype);
-    ShPVVector* polygons = segment->find<ShPVVector>(layername.data()).first;
 
-    for(ShPVVector::iterator iter = polygons->begin(); iter != polygons->end(); iter++)
+    polys.reserve(res.npolygons + 1);
+    for(size_t j = 0; j < res.npolygons; j++)
     {
         std::vector<pi> poly;
-        for(ShPVector::iterator piter = iter->begin(); piter != iter->end(); piter++)
+        poly.reserve(res.offsets[j+1] - res.offsets[j]);
+        for(int n = res.offsets[j]; n < res.offsets[j+1]; n++)
         {
-            poly.push_back(*piter);
+            poly.push_back(std::make_pair(res.points[2*n],res.points[2*n+1]));
         }
         polys.push_back(std::move(poly));
     }
-    mux_out->unlock();
+    release(res.ticket,res.part);
     return polys;
 
 }
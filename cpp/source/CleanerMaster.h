@@ -19,13 +19,21 @@
 
 #include <vector>
 #include "DrcSl.h"
+#include "JobQueue.h"
 #include <boost/array.hpp>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/interprocess/containers/vector.hpp>
 #include <boost/interprocess/allocators/allocator.hpp>
 #include <boost/interprocess/sync/named_mutex.hpp>
+#include <boost/interprocess/sync/named_condition.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
 #include <string>
+#include <set>
+#include <map>
+#include <cstring>
+#include <stdexcept>
 #include <cstdlib> //std::system
+#include <unistd.h>
 #include <utility>
 #include <iostream>
 
@@ -36,41 +44,86 @@ typedef std::pair<int,int> pi;
 
 typedef bi::allocator<int, bi::managed_shared_memory::segment_manager>  ShmemAllocatorInt;
 typedef bi::vector<int, ShmemAllocatorInt> ShIVector;
-typedef bi::allocator<ShIVector, bi::managed_shared_memory::segment_manager> ShmemAllocatorIVec;
-typedef bi::vector<ShIVector, ShmemAllocatorIVec> ShIVVector;
-typedef bi::allocator<pi, bi::managed_shared_memory::segment_manager> ShmemAllocatorPair;
-typedef bi::vector<pi,ShmemAllocatorPair> ShPVector;
-typedef bi::allocator<ShPVector, bi::managed_shared_memory::segment_manager> ShmemAllocatorPVec;
-typedef bi::vector<ShPVector, ShmemAllocatorPVec> ShPVVector;
 
 namespace drclean
 {
 
+//  Part of a cleaned layer mapped from the shared memory. Polygon j consists of the points offsets[j] to offsets[j+1]-1,
+//  which are stored as x,y in points. The layer consists of nparts parts, which are horizontal stripes with the
+//  extent x1,y1,x2,y2 whose polygons do not overlap.
+struct LayerResult
+{
+    int layer;
+    int datatype;
+    unsigned ticket;
+    int part;
+    int nparts;
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+    const int *offsets;
+    size_t npolygons;
+    const int *points;
+    size_t npoints;
+};
+
 class CleanerMaster
 {
 
 public:
     CleanerMaster();
-    CleanerMaster(int nlayers);
+    CleanerMaster(int nslots);
+    CleanerMaster(int nslots, const std::string &name);
     virtual ~CleanerMaster();
 
     int set_box(int layer, int datatype, int violation_width, int violation_space, int x1, int x2, int y1, int y2);
     void add_edge(int x1, int x2, int y1, int y2);
-    int done();
+    void add_edges(const int *edges, size_t n);
+    int done(int timeout_ms = 0);
 
-    std::vector<std::vector<int>> get_layer();
+    std::vector<std::vector<int>> get_layer(int timeout_ms = 0);
     bi::managed_shared_memory* segment;
-    std::vector<std::vector<pi>> get_polygons();
+    std::vector<std::vector<pi>> get_polygons(int timeout_ms = 0);
+    bool next_result(int timeout_ms, LayerResult &res);
+    void release(unsigned ticket, int part);
+    std::string name();
+    bool wait_ready(int timeout_ms);
+    bool alive(int max_age_ms);
+    void shutdown();
+    long long cache_hits();
+    long long cache_misses();
 
 private:
 
     std::vector<int> local_input;
+    //  Tickets of the layers which were queued, but whose result was not read yet.
+    std::set<unsigned> tickets;
+    //  Number of parts of a layer which were not released yet, known once the first part is read.
+    std::map<unsigned,int> unread;
+    //  Result segments by ticket and part which are mapped by next_result() until they are released.
+    std::map<std::pair<unsigned,int>,bi::mapped_region*> mapped;
+    std::string segment_name;
     ShmemAllocatorInt* alloc_inst;
-    ShIVector *input;
+    JobQueue *jobs;
+    EngineStatus *status;
     ShIVector *outList;
     bi::named_mutex* mux_inp;
     bi::named_mutex* mux_out;
-    ShPVVector *polygons;
+    //  Signalled with mux_inp held whenever a slot of the queue is published or freed again.
+    bi::named_condition* cv_inp;
+    //  Signalled with mux_out held whenever a part of a cleaned layer is added to outList.
+    bi::named_condition* cv_out;
+
+    bool next_layer(int timeout_ms, int &layer, int &datatype, unsigned &ticket, int &part);
+    void remove_shared();
+
+    //  Number of layers that can be queued for the slave at the same time.
+    static const int default_slots = 16;
+    //  Size of the segment with the queue and the list of cleaned layers.
+    static const size_t segment_size = 1 << 20;
+    //  Room for the bookkeeping of a segment on top of the data of a layer.
+    static const size_t segment_slack = 1 << 16;
 
 };
 }
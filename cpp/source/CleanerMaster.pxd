@@ -2,17 +2,43 @@
 
 from libcpp.vector cimport vector
 from libcpp.pair cimport pair
+from libcpp.string cimport string
 
 cdef extern from "CleanerMaster.cpp":
     pass
 
 cdef extern from "CleanerMaster.h" namespace "drclean":
+    cdef struct LayerResult:
+        int layer
+        int datatype
+        unsigned ticket
+        int part
+        int nparts
+        int x1
+        int y1
+        int x2
+        int y2
+        const int *offsets
+        size_t npolygons
+        const int *points
+        size_t npoints
+
     cdef cppclass CleanerMaster:
         CleanerMaster() except +
-        CleanerMaster(int nlayers) except +
+        CleanerMaster(int nslots) except +
+        CleanerMaster(int nslots, const string &name) except +
 
         int set_box(int layer, int datatype, int violation_width, int violation_space, int x1, int x2, int y1, int y2)
         void add_edge(int x1, int x2, int y1, int y2)
-        int done()
-        vector[vector[int]] get_layer()
-        vector[vector[pair[int,int]]] get_polygons()
+        void add_edges(const int *edges, size_t n) nogil
+        int done(int timeout_ms) except + nogil
+        vector[vector[int]] get_layer(int timeout_ms) except + nogil
+        vector[vector[pair[int,int]]] get_polygons(int timeout_ms) except + nogil
+        bint next_result(int timeout_ms, LayerResult &res) except + nogil
+        void release(unsigned ticket, int part)
+        string name()
+        bint wait_ready(int timeout_ms) except + nogil
+        bint alive(int max_age_ms) except +
+        void shutdown() except +
+        long long cache_hits() except +
+        long long cache_misses() except +
@@ -19,47 +19,31 @@
 
 namespace drclean
 {
-CleanerSlave::CleanerSlave()
+CleanerSlave::CleanerSlave(): CleanerSlave(boost::thread::hardware_concurrency())
 {
-    segment = new bi::managed_shared_memory(bi::open_only, "DRCleanEngine");
-    
-    std::cout<< "Initializing" << std::endl;
-
-    alloc_inst = new ShmemAllocatorInt(segment->get_segment_manager());
-    alloc_vec = new ShmemAllocatorIVec(segment->get_segment_manager());
-    alloc_pvec = new ShmemAllocatorPVec(segment->get_segment_manager());
-    alloc_poly = new ShmemAllocatorPair(segment->get_segment_manager());
-
-    input = segment->find<ShIVector>("input").first;
-    outList = segment->find<ShIVector>("outList").first;
-
-    mux_inp = new bi::named_mutex(bi::open_only, "mux_inp");
-    mux_out = new bi::named_mutex(bi::open_only, "mux_out");
-
-    pool = new boost::asio::thread_pool(boost::thread::hardware_concurrency());
+}
 
-    if (input)
-    {
-        initialized = true;
-    }
+CleanerSlave::CleanerSlave(int nthreads): CleanerSlave(nthreads,default_engine_name)
+{
 }
 
-CleanerSlave::CleanerSlave(int nthreads)
+//    Open the shared memory of the engine called name, which the master created, and start a pool of nthreads threads.
+CleanerSlave::CleanerSlave(int nthreads, const std::string &name): segment_name(name)
 {
-    segment = new bi::managed_shared_memory(bi::open_only, "DRCleanEngine");
+    segment = new bi::managed_shared_memory(bi::open_only, segment_name.data());
     
     std::cout<< "Initializing" << std::endl;
 
     alloc_inst = new ShmemAllocatorInt(segment->get_segment_manager());
-    alloc_vec = new ShmemAllocatorIVec(segment->get_segment_manager());
-    alloc_pvec = new ShmemAllocatorPVec(segment->get_segment_manager());
-    alloc_poly = new ShmemAllocatorPair(segment->get_segment_manager());
 
-    input = segment->find<ShIVector>("input").first;
+    jobs = segment->find<JobQueue>("jobs").first;
+    status = segment->find<EngineStatus>("status").first;
     outList = segment->find<ShIVector>("outList").first;
 
-    mux_inp = new bi::named_mutex(bi::open_only, "mux_inp");
-    mux_out = new bi::named_mutex(bi::open_only, "mux_out");
+    mux_inp = new bi::named_mutex(bi::open_only, sync_name(segment_name,"mux_inp").data());
+    mux_out = new bi::named_mutex(bi::open_only, sync_name(segment_name,"mux_out").data());
+    cv_inp = new bi::named_condition(bi::open_only, sync_name(segment_name,"cv_inp").data());
+    cv_out = new bi::named_condition(bi::open_only, sync_name(segment_name,"cv_out").data());
     
     int n = nthreads;
     
@@ -70,100 +54,461 @@ CleanerSlave::CleanerSlave(int nthreads)
         n = boost::thread::hardware_concurrency();
     }
 
+    this->nthreads = n;
     pool = new boost::asio::thread_pool(n);
 
-    if (input)
+    if (jobs && status)
     {
+        // Tell the master that the slave is ready.
+        mux_inp->lock();
+        status->slave_pid = getpid();
+        status->heartbeat = now_ms();
+        mux_inp->unlock();
+        cv_inp->notify_all();
         initialized = true;
     }
 }
 
+//    Finish the layers on the pool and detach from the master. If the master is gone, nobody else removes the shared
+//    memory of the engine, so the slave removes it together with the queued layers and the results that were not read.
 CleanerSlave::~CleanerSlave()
 {
     join_threads();
+    mux_inp->lock();
+    status->slave_pid = 0;
+    orphaned = orphaned || status->master_gone;
+    mux_inp->unlock();
+    cv_inp->notify_all();
+    if(orphaned)
+    {
+        for(JobSlot &slot: jobs->slots)
+        {
+            if(slot.state != JobSlot::free_slot)
+                bi::shared_memory_object::remove(job_name(segment_name,slot.ticket).data());
+        }
+        // outList holds layer, datatype, ticket and part of each result.
+        for(size_t i = 3; i < outList->size(); i += 4)
+        {
+            bi::shared_memory_object::remove(result_name(segment_name,(*outList)[i-1],(*outList)[i]).data());
+        }
+        bi::shared_memory_object::remove(segment_name.data());
+        bi::named_mutex::remove(sync_name(segment_name,"mux_inp").data());
+        bi::named_mutex::remove(sync_name(segment_name,"mux_out").data());
+        bi::named_condition::remove(sync_name(segment_name,"cv_inp").data());
+        bi::named_condition::remove(sync_name(segment_name,"cv_out").data());
+    }
+    delete cv_inp;
+    delete cv_out;
     delete alloc_inst;
     delete pool;
 }
 
+//    Take the oldest layer from the queue and clean it on the pool, if one of the threads is free. Waits up to 30 ms for
+//    a free thread and for a layer to be published. The layer is copied out of its segment, which is removed, so the
+//    master can reuse the slot while the layer is cleaned.
 void CleanerSlave::clean()
 {
-    std::vector<int> *inp = new std::vector<int>();
-    mux_inp->lock();
-    if(!input->empty())
     {
-        bi::vector<int, ShmemAllocatorInt>::iterator it;
-        for(it = input->begin(); it != input->end(); it++)
+        std::unique_lock<std::mutex> lock(mux_running);
+        auto has_free = [this]()
         {
-            inp->push_back(*it);
-        }
-        input->clear();
-        mux_inp->unlock();
+            return running < nthreads;
+        };
+        if(!cv_running.wait_for(lock,std::chrono::milliseconds(30),has_free))
+            return;
     }
-    else
-    {
-        mux_inp->unlock();
-        delete inp;
 
-        std::this_thread::sleep_for(std::chrono::milliseconds(30));
+    // Wait for the master to publish a layer. The wait is limited, so the caller can check for its stop signal.
+    int slot;
+    {
+        bi::scoped_lock<bi::named_mutex> lock(*mux_inp);
+        slot = jobs->take();
+        if(slot < 0)
+        {
+            cv_inp->timed_wait(lock,deadline(30),[this,&slot]()
+            {
+                return status->stop || (slot = jobs->take()) >= 0;
+            });
+        }
+    }
+    if(slot < 0)
         return;
+
+    unsigned ticket = jobs->slots[slot].ticket;
+    std::string name = job_name(segment_name,ticket);
+    std::unique_ptr<std::vector<int>> inp;
+    {
+        bi::managed_shared_memory job(bi::open_only, name.data());
+        ShIVector* data = job.find<ShIVector>("data").first;
+        inp.reset(new std::vector<int>(data->begin(),data->end()));
     }
+    bi::shared_memory_object::remove(name.data());
+    mux_inp->lock();
+    jobs->release(slot);
+    mux_inp->unlock();
+    cv_inp->notify_all();
 
-    boost::asio::post(*pool,boost::bind(&CleanerSlave::threaded_DrcSl,this,inp));
+    {
+        std::lock_guard<std::mutex> lock(mux_running);
+        running++;
+    }
+    // The master waits for a result of each layer, so a layer which fails is published as an error.
+    int layer = inp->size() > 1 ? (*inp)[0] : -1;
+    int datatype = inp->size() > 1 ? (*inp)[1] : -1;
+    boost::asio::post(*pool,[this,inp = std::move(inp),ticket,layer,datatype]() mutable
+    {
+        std::string error;
+        try
+        {
+            threaded_DrcSl(std::move(inp),ticket);
+        }
+        catch(std::exception &e)
+        {
+            error = e.what();
+            if(error.empty())
+                error = "unknown error";
+        }
+        catch(int code)
+        {
+            // DrcSl throws the index of the dimension which an edge outside of the box exceeds.
+            error = "an edge lies outside of the box, DrcSl error " + std::to_string(code);
+        }
+        catch(...)
+        {
+            error = "unknown error";
+        }
+        if(!error.empty())
+        {
+            try
+            {
+                publish_error(ticket,layer,datatype,error);
+            }
+            catch(...)
+            {
+                // Without shared memory for the error there is nothing left to tell the master.
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mux_running);
+            running--;
+        }
+        cv_running.notify_one();
+    });
 //        threaded_DrcSl(inp); //For single thread calculation
 }
 
-void CleanerSlave::threaded_DrcSl(std::vector<int> *inp)
+//    Clean the layer of the job with the given ticket and write its polygons into the segments
+//    result_name(segment_name,ticket,part). Large layers are written in several parts, each of which is published as
+//    soon as it is written, so the master can insert the first parts while the later ones are assembled. A layer which
+//    was cleaned before with the same box, rules and edges is published from the cache instead. Throws
+//    std::invalid_argument if the job is not layer, datatype, box and rules followed by whole edges.
+void CleanerSlave::threaded_DrcSl(std::unique_ptr<std::vector<int>> inp, unsigned ticket)
 {
     int layer;
     int datatype;
 
     DrcSl sl;
+    // A layer which was queued without set_box() or with a partial edge would be read past its end.
+    if(inp->size() < 8 || (inp->size() - 8) % 4)
+    {
+        throw std::invalid_argument("the layer has " + std::to_string(inp->size()) +
+                                    " values, expected 8 for its box and rules and 4 per edge");
+    }
     std::vector<int>::iterator iter = inp->begin();
+    layer = *(iter++);
+    datatype = *(iter++);
 
-    if(iter!=inp->end())
+    if(passthrough)
     {
-        layer = *(iter++);
-        datatype = *(iter++);
-        sl.initialize_list(*(iter),*(iter+1),*(iter+2),*(iter+3),*(iter+4),*(iter+5));
-        // The first six datapoints are size (x1,x2,y1,y2) and layer, datatype information.
-        int count = 6;
-        iter+=6;
-        while(iter!=inp->end())
+        publish_input(layer,datatype,ticket,*inp);
+        return;
+    }
+
+    // The key covers everything after layer and datatype, the results do not depend on them.
+    CacheKey key;
+    std::vector<int> cached;
+    bool use_cache = cache.enabled();
+    if(use_cache)
+    {
+        key = ResultCache::key(std::vector<int>{cache_parts},inp->data() + 2,inp->size() - 2);
+        bool found = cache.get(key,cached);
+        mux_inp->lock();
+        status->cache_hits = cache.hits();
+        status->cache_misses = cache.misses();
+        mux_inp->unlock();
+        if(found)
         {
-            count +=4;
-            sl.add_data(*(iter),*(iter+1),*(iter+2),*(iter+3));
-            iter+=4;
+            inp.reset();
+            publish_cached(layer,datatype,ticket,cached);
+            return;
         }
     }
+
+    sl.initialize_list(*(iter),*(iter+1),*(iter+2),*(iter+3),*(iter+4),*(iter+5));
+    // Large layers are rasterised, sorted and cleaned in chunks on the pool as well.
+    sl.set_threads(nthreads,[this](int n, const std::function<void(int)> &fn)
+    {
+        parallel_for(n,fn);
+    });
+    // The first eight datapoints are layer, datatype, size (x1,x2,y1,y2) and the space and width rules.
+    sl.add_edges(inp->data() + 8,(inp->size() - 8) / 4);
+
+    int nedges = (inp->size() - 8) / 4;
+    inp.reset();
+    sl.sortlist();
+
+    // Large layers are split into horizontal bands which are cleaned on the pool as well. Each band has to be at least
+    // a few halos high, otherwise the bands mostly consist of their overlap.
+    int nbands = std::min(nthreads,(sl.ver2 - sl.ver1) / (4 * sl.halo()));
+    if(nedges >= tile_min_edges && nbands > 1)
+    {
+        sl.clean_tiled(nbands,[this](int n, const std::function<void(int)> &fn)
+        {
+            parallel_for(n,fn);
+        });
+    }
     else
     {
-        delete inp;
-        return;
+        sl.clean();
     }
 
-    delete inp;
-    sl.sortlist();
-    sl.clean();
-    std::string layername = std::to_string(layer) + "/" + std::to_string(datatype);
+    // The parts are horizontal stripes of equal height like the bands. The scanlines of the box are ver1+2 to ver2-2.
+    int nparts = std::max(1,std::min(max_result_parts,nedges / part_edges));
+    int y1 = sl.ver1 + 2;
+    int y2 = sl.ver2 - 2;
+    std::vector<int> off;
+    std::vector<int> points;
+    cached.assign(1,nparts);
+    for(int part = 0; part < nparts; part++)
+    {
+        ResultHeader header;
+        header.layer = layer;
+        header.datatype = datatype;
+        header.part = part;
+        header.nparts = nparts;
+        header.x1 = sl.hor1 + 2;
+        header.x2 = sl.hor2 - 2;
+        header.y1 = y1 + (int)((long long)(y2 - y1) * part / nparts);
+        header.y2 = y1 + (int)((long long)(y2 - y1) * (part + 1) / nparts);
+        // The first and the last part also take anything outside of the box.
+        sl.get_polygons_flat(off,points,part ? header.y1 : INT_MIN,part + 1 < nparts ? header.y2 : INT_MAX);
+        publish(ticket,header,off,points);
 
-    std::vector<std::vector<pi>> polys = sl.get_polygons();
+        if(use_cache)
+        {
+            int sizes[] = {header.x1,header.y1,header.x2,header.y2,(int)off.size(),(int)points.size() / 2};
+            cached.insert(cached.end(),sizes,sizes + 6);
+            cached.insert(cached.end(),off.begin(),off.end());
+            cached.insert(cached.end(),points.begin(),points.end());
+        }
+    }
+    if(use_cache)
+        cache.put(key,cached);
+}
 
-    ShPVVector* polygons = segment->construct<ShPVVector>(layername.data())(*alloc_pvec);
+//    Publish the parts of a layer from the cache, which holds the number of parts followed by x1, y1, x2, y2, the
+//    number of offsets and of points, the offsets and the points of each part.
+void CleanerSlave::publish_cached(int layer, int datatype, unsigned ticket, const std::vector<int> &cached)
+{
+    std::vector<int>::const_iterator it = cached.begin();
+    int nparts = *(it++);
+    for(int part = 0; part < nparts; part++)
+    {
+        ResultHeader header;
+        header.layer = layer;
+        header.datatype = datatype;
+        header.part = part;
+        header.nparts = nparts;
+        header.x1 = *(it++);
+        header.y1 = *(it++);
+        header.x2 = *(it++);
+        header.y2 = *(it++);
+        int noffsets = *(it++);
+        int npoints = *(it++);
+        std::vector<int> off(it,it + noffsets);
+        it += noffsets;
+        std::vector<int> points(it,it + 2 * npoints);
+        it += 2 * npoints;
+        publish(ticket,header,off,points);
+    }
+}
 
-    for(auto p: polys)
+//    Publish the edges of the layer inp as they are, each as a polygon of its two points, instead of cleaning them. The
+//    edges are split into parts like a cleaned layer of the same size, but by their order and not into stripes.
+void CleanerSlave::publish_input(int layer, int datatype, unsigned ticket, const std::vector<int> &inp)
+{
+    int nedges = (inp.size() - 8) / 4;
+    int nparts = std::max(1,std::min(max_result_parts,nedges / part_edges));
+    std::vector<int> off;
+    std::vector<int> points;
+    for(int part = 0; part < nparts; part++)
     {
-        ShPVector* poly = segment->construct<ShPVector>(bi::anonymous_instance) (*alloc_poly);
-        for(auto pit: p)
+        ResultHeader header;
+        header.layer = layer;
+        header.datatype = datatype;
+        header.part = part;
+        header.nparts = nparts;
+        header.x1 = inp[2];
+        header.x2 = inp[3];
+        header.y1 = inp[4];
+        header.y2 = inp[5];
+        off.clear();
+        points.clear();
+        for(int i = (long long)nedges * part / nparts; i < (long long)nedges * (part + 1) / nparts; i++)
         {
-            poly->push_back(pit);
+            const int *e = inp.data() + 8 + 4 * i;
+            off.push_back(points.size() / 2);
+            points.insert(points.end(),{e[0],e[2],e[1],e[3]});
         }
-        polygons->push_back(boost::move(*poly));
+        off.push_back(points.size() / 2);
+        publish(ticket,header,off,points);
     }
+}
+
+//    Write a part of a cleaned layer into its segment and add it to outList.
+void CleanerSlave::publish(unsigned ticket, const ResultHeader &header, const std::vector<int> &off,
+                           const std::vector<int> &points)
+{
+    write_result(result_name(segment_name,ticket,header.part),header,off,points);
+    add_to_outlist(ticket,header);
+}
+
+//    Publish that the layer with the given ticket could not be cleaned as the part error_part with nparts -1. The
+//    segment holds the header followed by message, which the master throws.
+void CleanerSlave::publish_error(unsigned ticket, int layer, int datatype, const std::string &message)
+{
+    ResultHeader header = ResultHeader();
+    header.layer = layer;
+    header.datatype = datatype;
+    header.part = error_part;
+    header.nparts = -1;
+
+    std::string name = result_name(segment_name,ticket,error_part);
+    bi::shared_memory_object shm(bi::create_only, name.data(), bi::read_write);
+    try
+    {
+        shm.truncate(sizeof(ResultHeader) + message.size() + 1);
+        bi::mapped_region region(shm, bi::read_write);
+        ResultHeader *dst = static_cast<ResultHeader*>(region.get_address());
+        *dst = header;
+        char *text = reinterpret_cast<char*>(dst + 1);
+        std::copy(message.begin(),message.end(),text);
+        text[message.size()] = 0;
+    }
+    catch(...)
+    {
+        bi::shared_memory_object::remove(name.data());
+        throw;
+    }
+    add_to_outlist(ticket,header);
+}
+
+//    Add the part of header to outList, once its segment is written, and wake the master.
+void CleanerSlave::add_to_outlist(unsigned ticket, const ResultHeader &header)
+{
     mux_out->lock();
-    outList->push_back(layer);
-    outList->push_back(datatype);
+    outList->push_back(header.layer);
+    outList->push_back(header.datatype);
+    outList->push_back(ticket);
+    outList->push_back(header.part);
     mux_out->unlock();
+    cv_out->notify_all();
+}
 
+//    Check in with the master. Returns false once the master asked the slave to shut down or its process is gone, so
+//    the slave does not outlive the session it belongs to.
+bool CleanerSlave::keep_running()
+{
+    bi::scoped_lock<bi::named_mutex> lock(*mux_inp);
+    status->heartbeat = now_ms();
+    if(status->stop)
+        return false;
+    orphaned = kill(status->master_pid,0) != 0 && errno == ESRCH;
+    return !orphaned;
+}
+
+//    Write the polygons as offsets and points like DrcSl::get_polygons_flat() into a new segment with the given name. The
+//    segment is a single block of its final size, see ResultHeader, so writing it takes no allocations in the shared
+//    memory and the master maps it as it is. The sizes in header are set from off and points.
+void CleanerSlave::write_result(const std::string &name, ResultHeader header, const std::vector<int> &off,
+                                const std::vector<int> &points)
+{
+    bi::shared_memory_object shm(bi::create_only, name.data(), bi::read_write);
+    try
+    {
+        shm.truncate(result_size(off.size(),points.size() / 2));
+        bi::mapped_region region(shm, bi::read_write);
+
+        header.noffsets = off.size();
+        header.npoints = points.size() / 2;
+        ResultHeader *dst = static_cast<ResultHeader*>(region.get_address());
+        *dst = header;
+        int *data = reinterpret_cast<int*>(dst + 1);
+        std::copy(off.begin(),off.end(),data);
+        std::copy(points.begin(),points.end(),data + off.size());
+    }
+    catch(...)
+    {
+        bi::shared_memory_object::remove(name.data());
+        throw;
+    }
+}
+
+//    Run fn(0) to fn(n-1) on the thread pool and return when all of them are done. The calling thread works on the
+//    indices as well and only waits for the ones other threads have already started. Therefore this can be called from
+//    a job running on the pool itself without blocking it, even if all other threads of the pool are busy. The first
+//    exception thrown by fn is rethrown once all indices are done.
+void CleanerSlave::parallel_for(int n, const std::function<void(int)> &fn)
+{
+    struct State
+    {
+        std::atomic<int> next;
+        std::atomic<int> finished;
+        std::mutex mux;
+        std::condition_variable cv;
+        std::exception_ptr error;
+    };
+    std::shared_ptr<State> state = std::make_shared<State>();
+    state->next = 0;
+    state->finished = 0;
+
+    // Helpers that only get to run after all indices are taken return without touching fn.
+    auto work = [state,n,&fn]()
+    {
+        int i;
+        while((i = state->next++) < n)
+        {
+            try
+            {
+                fn(i);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lock(state->mux);
+                if(!state->error)
+                    state->error = std::current_exception();
+            }
+            if(++state->finished == n)
+            {
+                std::lock_guard<std::mutex> lock(state->mux);
+                state->cv.notify_all();
+            }
+        }
+    };
+
+    for(int i = 1; i < n; i++)
+    {
+        boost::asio::post(*pool,work);
+    }
+    work();
+
+    std::unique_lock<std::mutex> lock(state->mux);
+    state->cv.wait(lock,[&state,n]()
+    {
+        return state->finished == n;
+    });
+    if(state->error)
+        std::rethrow_exception(state->error);
 }
 
 void CleanerSlave::join_threads()
@@ -171,4 +516,19 @@ void CleanerSlave::join_threads()
     pool->join();
 }
 
+//    Keep up to capacity bytes of cleaned layers in memory and, unless directory is empty, all of them in files in
+//    directory, which has to exist. See ResultCache.
+void CleanerSlave::set_cache(size_t capacity, const std::string &directory)
+{
+    cache.set_capacity(capacity);
+    cache.set_directory(directory);
+}
+
+//    Publish the layers without cleaning them, see publish_input(). This measures the cost of the shared memory protocol
+//    on its own.
+void CleanerSlave::set_passthrough(bool passthrough)
+{
+    this->passthrough = passthrough;
+}
+
 };
@@ -23,6 +23,8 @@
 #include <boost/interprocess/containers/vector.hpp>
 #include <boost/interprocess/allocators/allocator.hpp>
 #include <boost/interprocess/sync/named_mutex.hpp>
+#include <boost/interprocess/sync/named_condition.hpp>
+#include <boost/interprocess/sync/scoped_lock.hpp>
 #include <boost/asio/thread_pool.hpp>
 #include <boost/asio.hpp>
 
@@ -31,6 +33,8 @@
 #include <utility>
 
 #include <signal.h>
+#include <unistd.h>
+#include <cerrno>
 
 #include <string>
 #include <cstdlib> //std::system
@@ -38,12 +42,21 @@
 #include <iostream>
 
 #include "DrcSl.h"
+#include "JobQueue.h"
+#include "ResultCache.h"
 #include "SignalHandler.h"
 
 #include <vector>
 
 #include <thread>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <exception>
+#include <stdexcept>
 
 namespace bi = boost::interprocess;
 
@@ -52,14 +65,6 @@ typedef std::pair<int,int> pi;
 typedef bi::allocator<int, bi::managed_shared_memory::segment_manager>  ShmemAllocatorInt;
 typedef bi::vector<int, ShmemAllocatorInt> ShIVector;
 
-typedef bi::allocator<ShIVector, bi::managed_shared_memory::segment_manager> ShmemAllocatorIVec;
-typedef bi::vector<ShIVector, ShmemAllocatorIVec> ShIVVector;
-
-typedef bi::allocator<pi, bi::managed_shared_memory::segment_manager> ShmemAllocatorPair;
-typedef bi::vector<pi,ShmemAllocatorPair> ShPVector;
-typedef bi::allocator<ShPVector, bi::managed_shared_memory::segment_manager> ShmemAllocatorPVec;
-typedef bi::vector<ShPVector, ShmemAllocatorPVec> ShPVVector;
-
 namespace drclean
 {
 
@@ -69,30 +74,62 @@ class CleanerSlave
 public:
     CleanerSlave();
     CleanerSlave(int nthreads);
+    CleanerSlave(int nthreads, const std::string &name);
     virtual ~CleanerSlave();
     bool initialized = false;
     void clean();
+    bool keep_running();
     void join_threads();
+    void set_cache(size_t capacity, const std::string &directory);
+    void set_passthrough(bool passthrough);
 
 private:
     bi::managed_shared_memory* segment;
 
     ShmemAllocatorInt* alloc_inst;
-    ShmemAllocatorIVec* alloc_vec;
-    ShmemAllocatorPVec* alloc_pvec;
-    ShmemAllocatorPair* alloc_poly;
 
-    ShIVector* input;
+    JobQueue* jobs;
+    EngineStatus* status;
     ShIVector* outList;
 
-    ShPVVector* polygons;
-
     bi::named_mutex* mux_inp;
     bi::named_mutex* mux_out;
-
-    void threaded_DrcSl(std::vector<int> *inp);
+    bi::named_condition* cv_inp;
+    bi::named_condition* cv_out;
+
+    std::string segment_name;
+    //  Set once the process of the master is gone or the master was deleted before the slave detached.
+    bool orphaned = false;
+
+    void threaded_DrcSl(std::unique_ptr<std::vector<int>> inp, unsigned ticket);
+    void write_result(const std::string &name, ResultHeader header, const std::vector<int> &off,
+                      const std::vector<int> &points);
+    void publish(unsigned ticket, const ResultHeader &header, const std::vector<int> &off,
+                 const std::vector<int> &points);
+    void publish_error(unsigned ticket, int layer, int datatype, const std::string &message);
+    void add_to_outlist(unsigned ticket, const ResultHeader &header);
+    void publish_cached(int layer, int datatype, unsigned ticket, const std::vector<int> &cached);
+    void publish_input(int layer, int datatype, unsigned ticket, const std::vector<int> &inp);
+    void parallel_for(int n, const std::function<void(int)> &fn);
 
     boost::asio::thread_pool * pool;
+    int nthreads;
+
+    //  Layers cleaned before, which are kept for the following cells.
+    ResultCache cache;
+    //  Return the input edges instead of cleaning them, which leaves only the cost of the protocol.
+    bool passthrough = false;
+
+    //  Number of layers being cleaned on the pool. A layer is only taken from the queue if fewer than nthreads are,
+    //  so the layers which can not be started yet stay in the queue.
+    int running = 0;
+    std::mutex mux_running;
+    std::condition_variable cv_running;
+
+    //  Layers with fewer edges are cleaned in one piece, splitting them into bands costs more than it gains.
+    static const int tile_min_edges = 20000;
+    //  Cleaned layers are published in parts of about this many input edges.
+    static const int part_edges = 20000;
 
 };
 
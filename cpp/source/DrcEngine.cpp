@@ -0,0 +1,822 @@
+//  This file is part of KLayoutPhotonicPCells, an extension for Photonic Layouts in KLayout.
+//  Copyright (c) 2018, Sebastian Goeldi
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "DrcEngine.h"
+
+#include <atomic>
+#include <memory>
+#include <algorithm>
+#include <map>
+#include <tuple>
+#include <exception>
+#include <stdexcept>
+#include <string>
+
+
+namespace drclean
+{
+
+//    Start nworkers worker threads, which wait for jobs until the pool is destroyed.
+ThreadPool::ThreadPool(int nworkers)
+{
+    for(int i = 0; i < nworkers; i++)
+    {
+        this->workers.emplace_back(&ThreadPool::work,this);
+    }
+}
+
+//    Let the workers finish the jobs that were already posted and join them.
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mux);
+        this->stop = true;
+    }
+    this->cv.notify_all();
+    for(std::thread &t : this->workers)
+    {
+        t.join();
+    }
+}
+
+void ThreadPool::post(const std::function<void()> &job)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mux);
+        this->jobs.push_back(job);
+    }
+    this->cv.notify_one();
+}
+
+void ThreadPool::work()
+{
+    while(true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(this->mux);
+            this->cv.wait(lock,[this]()
+            {
+                return this->stop || !this->jobs.empty();
+            });
+            if(this->jobs.empty())
+                return;
+            job = std::move(this->jobs.front());
+            this->jobs.pop_front();
+        }
+        job();
+    }
+}
+
+//    Number of threads that work on a parallel_for, which are the workers and the calling thread.
+int ThreadPool::size()
+{
+    return this->workers.size() + 1;
+}
+
+//    Run fn(0) to fn(n-1) on the pool and return when all of them are done. Like CleanerSlave::parallel_for, the calling
+//    thread works on the indices as well and only waits for the ones other threads have already started, so it can be
+//    called from a job running on the pool itself. The first exception thrown by fn is rethrown once all indices are done.
+void ThreadPool::parallel_for(int n, const std::function<void(int)> &fn)
+{
+    struct State
+    {
+        std::atomic<int> next;
+        std::atomic<int> finished;
+        std::mutex mux;
+        std::condition_variable cv;
+        std::exception_ptr error;
+    };
+    std::shared_ptr<State> state = std::make_shared<State>();
+    state->next = 0;
+    state->finished = 0;
+
+    // Helpers that only get to run after all indices are taken return without touching fn.
+    auto work = [state,n,&fn]()
+    {
+        int i;
+        while((i = state->next++) < n)
+        {
+            try
+            {
+                fn(i);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lock(state->mux);
+                if(!state->error)
+                    state->error = std::current_exception();
+            }
+            if(++state->finished == n)
+            {
+                std::lock_guard<std::mutex> lock(state->mux);
+                state->cv.notify_all();
+            }
+        }
+    };
+
+    int helpers = std::min<int>(n - 1,this->workers.size());
+    for(int i = 0; i < helpers; i++)
+    {
+        post(work);
+    }
+    work();
+
+    std::unique_lock<std::mutex> lock(state->mux);
+    state->cv.wait(lock,[&state,n]()
+    {
+        return state->finished >= n;
+    });
+    if(state->error)
+        std::rethrow_exception(state->error);
+}
+
+//    Number of threads to clean with, all cores of the machine if nthreads is smaller than one.
+static int engine_threads(int nthreads)
+{
+    if(nthreads < 1)
+        nthreads = std::thread::hardware_concurrency();
+    return std::max(1,nthreads);
+}
+
+//    Whether the rectangles x1, y1, x2, y2 at p and q share an area.
+static inline bool overlap(const int *p, const int *q)
+{
+    return p[0] < q[2] && q[0] < p[2] && p[1] < q[3] && q[1] < p[3];
+}
+
+//    Append the rectangles x1, y1, x2, y2 of rects grown by d on all sides and moved by dx, dy to out.
+static void place_rects(const std::vector<int> &rects, int d, int dx, int dy, std::vector<int> &out)
+{
+    for(size_t i = 0; i < rects.size(); i += 4)
+    {
+        out.push_back(rects[i] - d + dx);
+        out.push_back(rects[i+1] - d + dy);
+        out.push_back(rects[i+2] + d + dx);
+        out.push_back(rects[i+3] + d + dy);
+    }
+}
+
+//    Append the rectangles of rects which share an area with box to out.
+static void rects_near(const std::vector<int> &rects, const int *box, std::vector<int> &out)
+{
+    for(size_t i = 0; i < rects.size(); i += 4)
+    {
+        if(overlap(&rects[i],box))
+            out.insert(out.end(),rects.begin() + i,rects.begin() + i + 4);
+    }
+}
+
+//    Boolean operation on the rectangles x1, y1, x2, y2 of a and b, which may overlap each other. keep(na, nb) decides
+//    from the number of rectangles of a and of b covering a point whether the point is part of the result, it has to
+//    be false for no rectangles. The rectangles of the result do not overlap and are appended to out.
+//
+//    The plane is swept upwards in slabs between the y coordinates of the rectangles. The intervals of a slab are
+//    merged with the rectangles of the slab below like in DrcSl::get_rectangles(), so rectangles only end where the
+//    intervals change.
+template<class Keep>
+static void rect_boolean(const std::vector<int> &a, const std::vector<int> &b, Keep keep, std::vector<int> &out)
+{
+    //  Change of the coverage at x.
+    struct XEvent
+    {
+        int x;
+        int da;
+        int db;
+    };
+
+    //  The rectangles of b are referred to as ~i.
+    auto rect = [&a,&b](int r)
+    {
+        return r >= 0 ? &a[4*r] : &b[4*~r];
+    };
+
+    std::vector<int> order;
+    for(size_t i = 0; i < a.size() / 4; i++)
+        order.push_back(i);
+    for(size_t i = 0; i < b.size() / 4; i++)
+        order.push_back(~(int)i);
+    order.erase(std::remove_if(order.begin(),order.end(),[&rect](int r)
+    {
+        return rect(r)[0] >= rect(r)[2] || rect(r)[1] >= rect(r)[3];
+    }),order.end());
+    std::sort(order.begin(),order.end(),[&rect](int r, int s)
+    {
+        return rect(r)[1] < rect(s)[1];
+    });
+
+    std::vector<int> ys;
+    for(int r: order)
+    {
+        ys.push_back(rect(r)[1]);
+        ys.push_back(rect(r)[3]);
+    }
+    std::sort(ys.begin(),ys.end());
+    ys.erase(std::unique(ys.begin(),ys.end()),ys.end());
+
+    std::vector<int> active;
+    std::vector<XEvent> xs;
+    //  Rectangles of out which reach up to open_end, in the order of their intervals.
+    std::vector<size_t> open;
+    std::vector<size_t> next;
+    int open_end = 0;
+    size_t o = 0;
+    for(size_t k = 0; k + 1 < ys.size(); k++)
+    {
+        int y = ys[k];
+        int h = ys[k+1] - y;
+        for(; o < order.size() && rect(order[o])[1] == y; o++)
+            active.push_back(order[o]);
+        active.erase(std::remove_if(active.begin(),active.end(),[&rect,y](int r)
+        {
+            return rect(r)[3] <= y;
+        }),active.end());
+
+        xs.clear();
+        for(int r: active)
+        {
+            xs.push_back(XEvent{rect(r)[0],r >= 0,r < 0});
+            xs.push_back(XEvent{rect(r)[2],-(r >= 0),-(r < 0)});
+        }
+        std::sort(xs.begin(),xs.end(),[](const XEvent &e, const XEvent &f)
+        {
+            return e.x < f.x;
+        });
+
+        if(open_end != y)
+            open.clear();
+        next.clear();
+        size_t j = 0;
+        int na = 0;
+        int nb = 0;
+        int x1 = 0;
+        bool inside = false;
+        for(size_t e = 0; e < xs.size();)
+        {
+            int x = xs[e].x;
+            for(; e < xs.size() && xs[e].x == x; e++)
+            {
+                na += xs[e].da;
+                nb += xs[e].db;
+            }
+            bool in = keep(na,nb);
+            if(in && !inside)
+                x1 = x;
+            if(!in && inside)
+            {
+                while(j < open.size() && out[4*open[j]] < x1)
+                    j++;
+                if(j < open.size() && out[4*open[j]] == x1 && out[4*open[j]+2] == x)
+                {
+                    out[4*open[j]+3] += h;
+                    next.push_back(open[j]);
+                    j++;
+                }
+                else
+                {
+                    next.push_back(out.size() / 4);
+                    out.push_back(x1);
+                    out.push_back(y);
+                    out.push_back(x);
+                    out.push_back(y+h);
+                }
+            }
+            inside = in;
+        }
+        open.swap(next);
+        open_end = y + h;
+    }
+}
+
+//    Append the rectangles of rects moved by dx, dy to out, but only their parts inside of the rectangles of zone if
+//    inside is set and otherwise only the parts outside of them. Only the rectangles close to the zone are cut.
+static void place_cut(const std::vector<int> &rects, int dx, int dy, const std::vector<int> &zone, bool inside,
+                      std::vector<int> &out)
+{
+    if(zone.empty())
+    {
+        if(!inside)
+            place_rects(rects,0,dx,dy,out);
+        return;
+    }
+
+    int box[4] = {zone[0],zone[1],zone[2],zone[3]};
+    for(size_t i = 4; i < zone.size(); i += 4)
+    {
+        box[0] = std::min(box[0],zone[i]);
+        box[1] = std::min(box[1],zone[i+1]);
+        box[2] = std::max(box[2],zone[i+2]);
+        box[3] = std::max(box[3],zone[i+3]);
+    }
+
+    std::vector<int> close;
+    for(size_t i = 0; i < rects.size(); i += 4)
+    {
+        int r[4] = {rects[i] + dx,rects[i+1] + dy,rects[i+2] + dx,rects[i+3] + dy};
+        if(overlap(r,box))
+            close.insert(close.end(),r,r + 4);
+        else if(!inside)
+            out.insert(out.end(),r,r + 4);
+    }
+    rect_boolean(close,zone,[inside](int na, int nb)
+    {
+        return na > 0 && (nb > 0) == inside;
+    },out);
+}
+
+//    Union of the rectangles of rects grown by d.
+static void grow_union(const std::vector<int> &rects, int d, std::vector<int> &out)
+{
+    std::vector<int> grown;
+    place_rects(rects,d,0,0,grown);
+    out.clear();
+    rect_boolean(grown,std::vector<int>(),[](int na, int)
+    {
+        return na > 0;
+    },out);
+}
+
+//    Band of the points closer than d to the border of the union of zone, on both sides of it.
+static void border_band(const std::vector<int> &zone, int d, std::vector<int> &band)
+{
+    std::vector<int> frame{zone[0],zone[1],zone[2],zone[3]};
+    for(size_t i = 4; i < zone.size(); i += 4)
+    {
+        frame[0] = std::min(frame[0],zone[i]);
+        frame[1] = std::min(frame[1],zone[i+1]);
+        frame[2] = std::max(frame[2],zone[i+2]);
+        frame[3] = std::max(frame[3],zone[i+3]);
+    }
+    frame = {frame[0] - d - 1,frame[1] - d - 1,frame[2] + d + 1,frame[3] + d + 1};
+
+    std::vector<int> outside;
+    std::vector<int> near_zone;
+    std::vector<int> near_outside;
+    rect_boolean(frame,zone,[](int na, int nb)
+    {
+        return na > 0 && nb == 0;
+    },outside);
+    grow_union(zone,d,near_zone);
+    grow_union(outside,d,near_outside);
+    band.clear();
+    rect_boolean(near_zone,near_outside,[](int na, int nb)
+    {
+        return na > 0 && nb > 0;
+    },band);
+}
+
+//    Rectangles of the merged edges of l before cleaning.
+static void input_rects(const EngineLayer &l, std::vector<int> &rects)
+{
+    DrcSl sl;
+    sl.initialize_list(l.x1,l.x2,l.y1,l.y2,l.violation_space,l.violation_width);
+    sl.add_edges(l.edges.data(),l.edges.size() / 4);
+    sl.sortlist();
+    sl.get_rectangles(rects);
+}
+
+//    Append the edges of the rectangles x1, y1, x2, y2 of rects to edges, the left side of each rectangle upwards and
+//    the right side downwards.
+static void rect_edges(const std::vector<int> &rects, std::vector<int> &edges)
+{
+    for(size_t i = 0; i < rects.size(); i += 4)
+    {
+        const int *r = &rects[i];
+        int e[8] = {r[0],r[0],r[1],r[3],r[2],r[2],r[3],r[1]};
+        edges.insert(edges.end(),e,e + 8);
+    }
+}
+
+//    Whether violations are left in sl, found by the passes of clean() in rows and in columns. A pass which finds no
+//    violations does not change sl, the first one which does fixes them and the search stops there.
+static bool violations(DrcSl &sl)
+{
+    for(int orientation = 0; orientation < 2; orientation++)
+    {
+        if(orientation)
+            sl.switch_dimensions();
+        if(sl.clean_space() || sl.clean_width())
+            return true;
+    }
+    return false;
+}
+
+//    Whether violations of the rules of the cleaned layer l are left in its rectangles.
+static bool violations(const EngineLayer &l)
+{
+    std::vector<int> edges;
+    rect_edges(l.rects,edges);
+    DrcSl sl;
+    sl.initialize_list(l.x1,l.x2,l.y1,l.y2,l.violation_space,l.violation_width);
+    sl.add_edges(edges.data(),edges.size() / 4);
+    sl.sortlist();
+    return violations(sl);
+}
+
+//    Constructor. Starts the thread pool, the calling thread of run() works on the layers as well.
+DrcEngine::DrcEngine(int nthreads): pool(engine_threads(nthreads) - 1)
+{
+}
+
+//    Add a layer with its rules, bounding box and n edges x1, x2, y1, y2 to the next run. The edges are copied.
+//    Returns the index of the layer.
+int DrcEngine::add_layer(int layer, int datatype, int violation_width, int violation_space, int x1, int x2, int y1,
+                         int y2, const int *edges, size_t n)
+{
+    EngineLayer l;
+    l.layer = layer;
+    l.datatype = datatype;
+    l.violation_width = violation_width;
+    l.violation_space = violation_space;
+    l.x1 = x1;
+    l.x2 = x2;
+    l.y1 = y1;
+    l.y2 = y2;
+    l.edges.assign(edges,edges + 4 * n);
+    this->layers.push_back(std::move(l));
+    return this->layers.size() - 1;
+}
+
+//    Add a layer like above, which also places ninstances cells of add_cell() stored as cell, dx, dy one after another.
+//    The bounding box has to include the instances. Each cell is only cleaned once for all instances of all layers with
+//    the same rules, see compose_layer().
+int DrcEngine::add_layer(int layer, int datatype, int violation_width, int violation_space, int x1, int x2, int y1,
+                         int y2, const int *edges, size_t n, const int *instances, size_t ninstances)
+{
+    for(size_t k = 0; k < ninstances; k++)
+    {
+        if(instances[3*k] < 0 || instances[3*k] >= (int)this->cells.size())
+            throw std::out_of_range("DrcEngine: no cell " + std::to_string(instances[3*k]));
+    }
+    int i = add_layer(layer,datatype,violation_width,violation_space,x1,x2,y1,y2,edges,n);
+    this->layers[i].instances.assign(instances,instances + 3 * ninstances);
+    return i;
+}
+
+//    Add the layer of a cell with its bounding box and n edges x1, x2, y1, y2 in the coordinates of the cell, which
+//    layers can place with add_layer(). A cell in another orientation is added as a cell of its own. Returns the index
+//    of the cell.
+int DrcEngine::add_cell(int x1, int x2, int y1, int y2, const int *edges, size_t n)
+{
+    EngineCell c;
+    c.x1 = x1;
+    c.x2 = x2;
+    c.y1 = y1;
+    c.y2 = y2;
+    c.edges.assign(edges,edges + 4 * n);
+    this->cells.push_back(std::move(c));
+    return this->cells.size() - 1;
+}
+
+//    Clean all layers which were added concurrently. Returns once all of them are done, the first error of a layer is
+//    rethrown afterwards.
+void DrcEngine::run(int max_tries)
+{
+    // Each cell is cleaned once for every set of rules it is placed with, together with the layers without instances.
+    std::vector<EngineLayer> cleaned;
+    std::vector<std::vector<int>> cleaned_of(this->layers.size());
+    std::map<std::tuple<int,int,int>,int> index;
+    for(size_t i = 0; i < this->layers.size(); i++)
+    {
+        EngineLayer &l = this->layers[i];
+        if(l.instances.empty())
+            continue;
+        cleaned_of[i].assign(this->cells.size(),-1);
+        for(size_t k = 0; k < l.instances.size(); k += 3)
+        {
+            int c = l.instances[k];
+            std::tuple<int,int,int> key(c,l.violation_width,l.violation_space);
+            std::map<std::tuple<int,int,int>,int>::iterator it = index.find(key);
+            if(it == index.end())
+            {
+                EngineLayer job;
+                job.layer = l.layer;
+                job.datatype = l.datatype;
+                job.violation_width = l.violation_width;
+                job.violation_space = l.violation_space;
+                job.x1 = this->cells[c].x1;
+                job.x2 = this->cells[c].x2;
+                job.y1 = this->cells[c].y1;
+                job.y2 = this->cells[c].y2;
+                job.edges = this->cells[c].edges;
+                it = index.emplace(key,cleaned.size()).first;
+                cleaned.push_back(std::move(job));
+            }
+            cleaned_of[i][c] = it->second;
+        }
+    }
+
+    // A cell which cleaning leaves violations in would repeat them with every instance.
+    int nlayers = this->layers.size();
+    std::vector<std::vector<int>> inputs(cleaned.size());
+    std::vector<char> dirty(cleaned.size(),0);
+    this->pool.parallel_for(nlayers + cleaned.size(),[this,max_tries,nlayers,&cleaned,&inputs,&dirty](int i)
+    {
+        if(i >= nlayers)
+        {
+            EngineLayer &c = cleaned[i - nlayers];
+            input_rects(c,inputs[i - nlayers]);
+            dirty[i - nlayers] = clean_layer(c,max_tries,true);
+        }
+        else if(this->layers[i].instances.empty())
+            clean_layer(this->layers[i],max_tries);
+    });
+
+    this->pool.parallel_for(nlayers,[this,max_tries,&cleaned,&inputs,&dirty,&cleaned_of](int i)
+    {
+        if(!this->layers[i].instances.empty())
+            compose_layer(this->layers[i],cleaned,inputs,dirty,cleaned_of[i],max_tries);
+    });
+}
+
+//    Clean one layer in the same steps as the cleaner process does and keep the rectangles of the result. A layer
+//    which was cleaned before with the same edges, bounding box and rules is taken from the cache instead.
+//
+//    clean() stops once the passes of one orientation find no violations, those of the other one can be left. If settle
+//    is set, cleaning is repeated from the other orientation until neither has violations left, at most max_tries
+//    times. Returns whether violations are left then, always false if settle is not set.
+bool DrcEngine::clean_layer(EngineLayer &l, int max_tries, bool settle)
+{
+    CacheKey key;
+    bool cached = this->results.enabled();
+    bool rules = l.violation_width != 1 && l.violation_space != 1;
+    if(cached)
+    {
+        std::vector<int> params{cache_rectangles,l.x1,l.x2,l.y1,l.y2,l.violation_space,l.violation_width,max_tries};
+        if(settle)
+            params.push_back(settle);
+        key = ResultCache::key(params,l.edges.data(),l.edges.size());
+        if(this->results.get(key,l.rects))
+        {
+            std::vector<int>().swap(l.edges);
+            return settle && rules && violations(l);
+        }
+    }
+
+    ParallelFor pfor = [this](int n, const std::function<void(int)> &fn)
+    {
+        this->pool.parallel_for(n,fn);
+    };
+
+    DrcSl sl;
+    sl.initialize_list(l.x1,l.x2,l.y1,l.y2,l.violation_space,l.violation_width);
+    sl.set_threads(this->pool.size(),pfor);
+    sl.add_edges(l.edges.data(),l.edges.size() / 4);
+    int nedges = l.edges.size() / 4;
+    std::vector<int>().swap(l.edges);
+    sl.sortlist();
+
+    // Rules of one database unit can not be violated, like in kppc.drc.clean() such layers are only merged.
+    bool left = false;
+    if(rules)
+    {
+        int nbands = std::min(this->pool.size(),(sl.ver2 - sl.ver1) / (4 * sl.halo()));
+        if(nedges >= tile_min_edges && nbands > 1)
+            sl.clean_tiled(nbands,pfor,max_tries);
+        else
+            sl.clean(max_tries);
+        for(int i = 0; settle && (left = violations(sl)) && i < max_tries; i++)
+        {
+            sl.switch_dimensions();
+            sl.clean(max_tries);
+        }
+        // The rectangles are taken from the rows, the last DRC pass can end in columns.
+        if(sl.get_orientation())
+            sl.switch_dimensions();
+    }
+    sl.get_rectangles(l.rects);
+    if(cached)
+        this->results.put(key,l.rects);
+    return left;
+}
+
+//    Assemble a layer with instances from its cleaned cells. inputs holds the rectangles of the cells before cleaning,
+//    dirty whether violations are left in a cleaned cell and cleaned_of is the index into cleaned, inputs and dirty for
+//    each cell.
+//
+//    An instance which has no other geometry closer than the space rule is already clean as its cell is. Zones are laid
+//    around the places where the boxes of instances come that close to each other and around the own edges of the
+//    layer, and grown by DrcSl::halo(), which is about as far as cleaning moves geometry from a violation. The zones
+//    are cleaned again from the own edges and the input of the instances reaching another halo beyond them, and the
+//    cleaned instances are placed around them. The work grows with the unique cells and the zones instead of the
+//    instances.
+//
+//    The cleaned zones have to fit to the cleaned instances at their borders. Where they do not, the instances there
+//    are taken into the zones as a whole and the zones are cleaned again. How often the cleaning steps are repeated
+//    depends on all violations of a layer, so cleaning can leave violations in a cell or a zone which it would have
+//    removed from the flattened layer. Cells and zones are cleaned until a DRC pass over them in rows and in columns
+//    finds no violations, see clean_layer(), and clean cells and zones which fit to each other leave none in the layer.
+//    If a placed cell or a zone stays dirty or a zone does not fit, the flattened layer is cleaned instead. So the
+//    result is either free of violations or the one of the flattened layer.
+void DrcEngine::compose_layer(EngineLayer &l, const std::vector<EngineLayer> &cleaned,
+                              const std::vector<std::vector<int>> &inputs, const std::vector<char> &dirty,
+                              const std::vector<int> &cleaned_of, int max_tries)
+{
+    int space = l.violation_space;
+    int halo = DrcSl::halo(space,l.violation_width);
+    size_t ninstances = l.instances.size() / 3;
+    auto any = [](int na, int)
+    {
+        return na > 0;
+    };
+    auto both = [](int na, int nb)
+    {
+        return na > 0 && nb > 0;
+    };
+
+    std::vector<int> own;
+    input_rects(l,own);
+    std::vector<int>().swap(l.edges);
+
+    // Cleans the geometry of input with the rules and the box of l, see clean_layer() for settle.
+    auto clean_input = [this,&l,&any,max_tries](const std::vector<int> &input, bool settle, EngineLayer &z)
+    {
+        // Overlapping instances overlap with their rectangles as well.
+        std::vector<int> merged;
+        rect_boolean(input,std::vector<int>(),any,merged);
+        z.layer = l.layer;
+        z.datatype = l.datatype;
+        z.violation_width = l.violation_width;
+        z.violation_space = l.violation_space;
+        z.x1 = l.x1;
+        z.x2 = l.x2;
+        z.y1 = l.y1;
+        z.y2 = l.y2;
+        rect_edges(merged,z.edges);
+        return clean_layer(z,max_tries,settle);
+    };
+    // Cleans the flattened layer instead, like a layer without instances.
+    auto clean_flat = [this,&l,&own,&inputs,&cleaned_of,ninstances,&clean_input]()
+    {
+        std::vector<int> input = own;
+        for(size_t k = 0; k < ninstances; k++)
+            place_rects(inputs[cleaned_of[l.instances[3*k]]],0,l.instances[3*k+1],l.instances[3*k+2],input);
+        EngineLayer z;
+        clean_input(input,false,z);
+        l.rects.swap(z.rects);
+    };
+
+    for(size_t k = 0; k < ninstances; k++)
+    {
+        if(dirty[cleaned_of[l.instances[3*k]]])
+        {
+            clean_flat();
+            return;
+        }
+    }
+
+    std::vector<int> boxes;
+    for(size_t k = 0; k < ninstances; k++)
+    {
+        const EngineCell &c = this->cells[l.instances[3*k]];
+        int dx = l.instances[3*k+1];
+        int dy = l.instances[3*k+2];
+        int box[4] = {c.x1 + dx,c.y1 + dy,c.x2 + dx,c.y2 + dy};
+        boxes.insert(boxes.end(),box,box + 4);
+    }
+
+    std::vector<int> grown;
+    std::vector<int> seeds;
+    place_rects(boxes,space,0,0,grown);
+    rect_boolean(grown,std::vector<int>(),[](int na, int)
+    {
+        return na > 1;
+    },seeds);
+    place_rects(own,space,0,0,seeds);
+
+    std::vector<int> zone;
+    std::vector<int> near;
+    std::vector<char> whole(ninstances,0);
+    l.rects.clear();
+    while(!seeds.empty())
+    {
+        std::vector<int> context;
+        grow_union(seeds,halo,zone);
+        grow_union(zone,halo,context);
+
+        std::vector<int> input = own;
+        for(size_t k = 0; k < ninstances; k++)
+        {
+            near.clear();
+            rects_near(context,&boxes[4*k],near);
+            if(!near.empty())
+                place_cut(inputs[cleaned_of[l.instances[3*k]]],l.instances[3*k+1],l.instances[3*k+2],near,true,input);
+        }
+        EngineLayer z;
+        bool left = clean_input(input,true,z);
+
+        // Around the border of the zones the cleaned zones have to be the same as the cleaned instances, which are all
+        // of the geometry there.
+        std::vector<int> band;
+        std::vector<int> placed;
+        std::vector<int> cleaned_band;
+        std::vector<int> placed_band;
+        std::vector<int> mismatch;
+        border_band(zone,space + l.violation_width,band);
+        for(size_t k = 0; k < ninstances; k++)
+        {
+            near.clear();
+            rects_near(band,&boxes[4*k],near);
+            if(!near.empty())
+                place_cut(cleaned[cleaned_of[l.instances[3*k]]].rects,l.instances[3*k+1],l.instances[3*k+2],near,true,
+                          placed);
+        }
+        rect_boolean(z.rects,band,both,cleaned_band);
+        rect_boolean(placed,band,both,placed_band);
+        rect_boolean(cleaned_band,placed_band,[](int na, int nb)
+        {
+            return (na > 0) != (nb > 0);
+        },mismatch);
+
+        bool retry = false;
+        for(size_t k = 0; k < ninstances; k++)
+        {
+            if(whole[k])
+                continue;
+            int box[4] = {boxes[4*k] - space,boxes[4*k+1] - space,boxes[4*k+2] + space,boxes[4*k+3] + space};
+            near.clear();
+            rects_near(mismatch,box,near);
+            if(!near.empty())
+            {
+                whole[k] = 1;
+                seeds.insert(seeds.end(),box,box + 4);
+                retry = true;
+            }
+        }
+        if(!retry)
+        {
+            if(left || !mismatch.empty())
+            {
+                clean_flat();
+                return;
+            }
+            rect_boolean(z.rects,zone,both,l.rects);
+            break;
+        }
+    }
+
+    for(size_t k = 0; k < ninstances; k++)
+    {
+        near.clear();
+        rects_near(zone,&boxes[4*k],near);
+        const std::vector<int> &rects = cleaned[cleaned_of[l.instances[3*k]]].rects;
+        place_cut(rects,l.instances[3*k+1],l.instances[3*k+2],near,false,l.rects);
+    }
+}
+
+//    Number of layers added since the last clear().
+int DrcEngine::size()
+{
+    return this->layers.size();
+}
+
+//    Layer and datatype of layer i.
+pi DrcEngine::get_layer(int i)
+{
+    if(i < 0 || i >= (int)this->layers.size())
+        throw std::out_of_range("DrcEngine: no layer " + std::to_string(i));
+    return std::make_pair(this->layers[i].layer,this->layers[i].datatype);
+}
+
+//    Move the rectangles x1, y1, x2, y2 of the cleaned layer i into rects. Each layer can only be retrieved once.
+void DrcEngine::get_rectangles(int i, std::vector<int> &rects)
+{
+    if(i < 0 || i >= (int)this->layers.size())
+        throw std::out_of_range("DrcEngine: no layer " + std::to_string(i));
+    rects.clear();
+    rects.swap(this->layers[i].rects);
+}
+
+//    Remove all layers and cells, the threads are kept.
+void DrcEngine::clear()
+{
+    this->layers.clear();
+    this->cells.clear();
+}
+
+//    Number of threads that clean the layers.
+int DrcEngine::threads()
+{
+    return this->pool.size();
+}
+
+//    Cache of the cleaned layers, see ResultCache.
+ResultCache &DrcEngine::cache()
+{
+    return this->results;
+}
+
+}
@@ -0,0 +1,121 @@
+//  This file is part of KLayoutPhotonicPCells, an extension for Photonic Layouts in KLayout.
+//  Copyright (c) 2018, Sebastian Goeldi
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef DRCENGINE_H
+#define DRCENGINE_H
+
+#include "DrcSl.h"
+#include "ResultCache.h"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+typedef std::pair<int,int> pi;
+
+namespace drclean
+{
+
+//  Fixed number of worker threads which run the posted jobs in the order they were posted.
+class ThreadPool
+{
+public:
+    ThreadPool(int nworkers);
+    ~ThreadPool();
+    void post(const std::function<void()> &job);
+    void parallel_for(int n, const std::function<void(int)> &fn);
+    int size();
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mux;
+    std::condition_variable cv;
+    bool stop = false;
+
+    void work();
+};
+
+//  One layer of a cell with its rules and edges and, once it is cleaned, its rectangles.
+struct EngineLayer
+{
+    int layer;
+    int datatype;
+    int violation_width;
+    int violation_space;
+    int x1;
+    int x2;
+    int y1;
+    int y2;
+    std::vector<int> edges;
+    //  Cells added with DrcEngine::add_cell() which are placed on the layer besides the edges, as cell, dx, dy of
+    //  each instance.
+    std::vector<int> instances;
+    std::vector<int> rects;
+};
+
+//  Layer of a cell which is placed by the instances of hierarchical layers, in the coordinates of the cell.
+struct EngineCell
+{
+    int x1;
+    int x2;
+    int y1;
+    int y2;
+    std::vector<int> edges;
+};
+
+//  Cleaner for all layers of a cell in the calling process. The layers are cleaned concurrently on a thread pool, large
+//  layers are split up further on the same pool like in the cleaner process. The pool is kept for the following cells.
+class DrcEngine
+{
+public:
+    DrcEngine(int nthreads = 0);
+
+    int add_layer(int layer, int datatype, int violation_width, int violation_space, int x1, int x2, int y1, int y2,
+                  const int *edges, size_t n);
+    int add_layer(int layer, int datatype, int violation_width, int violation_space, int x1, int x2, int y1, int y2,
+                  const int *edges, size_t n, const int *instances, size_t ninstances);
+    int add_cell(int x1, int x2, int y1, int y2, const int *edges, size_t n);
+    void run(int max_tries = 10);
+    int size();
+    pi get_layer(int i);
+    void get_rectangles(int i, std::vector<int> &rects);
+    void clear();
+    int threads();
+    ResultCache &cache();
+
+private:
+    ThreadPool pool;
+    std::vector<EngineLayer> layers;
+    std::vector<EngineCell> cells;
+    //  Layers cleaned before, which are kept for the following cells.
+    ResultCache results;
+
+    bool clean_layer(EngineLayer &l, int max_tries, bool settle = false);
+    void compose_layer(EngineLayer &l, const std::vector<EngineLayer> &cleaned,
+                       const std::vector<std::vector<int>> &inputs, const std::vector<char> &dirty,
+                       const std::vector<int> &cleaned_of, int max_tries);
+
+    //  Layers with fewer edges are cleaned in one piece, splitting them into bands costs more than it gains.
+    static const int tile_min_edges = 20000;
+};
+
+}
+
+#endif // DRCENGINE_H
@@ -0,0 +1,35 @@
+# distutils: language=c++
+from libcpp.vector cimport vector
+from libcpp.pair cimport pair
+from libcpp.string cimport string
+
+
+cdef extern from "DrcEngine.cpp":
+    pass
+
+cdef extern from "ResultCache.cpp":
+    pass
+
+cdef extern from "ResultCache.h" namespace "drclean":
+    cdef cppclass ResultCache:
+        void set_capacity(size_t capacity)
+        void set_directory(const string &directory)
+        long long hits()
+        long long misses()
+
+cdef extern from "DrcEngine.h" namespace "drclean":
+    cdef cppclass DrcEngine:
+        DrcEngine(int nthreads) except +
+
+        int add_layer(int layer, int datatype, int violation_width, int violation_space, int x1, int x2, int y1, int y2,
+                      const int *edges, size_t n) except +
+        int add_layer(int layer, int datatype, int violation_width, int violation_space, int x1, int x2, int y1, int y2,
+                      const int *edges, size_t n, const int *instances, size_t ninstances) except +
+        int add_cell(int x1, int x2, int y1, int y2, const int *edges, size_t n)
+        void run(int max_tries) except + nogil
+        int size()
+        pair[int,int] get_layer(int i) except +
+        void get_rectangles(int i, vector[int] &rects) except +
+        void clear()
+        int threads()
+        ResultCache &cache()
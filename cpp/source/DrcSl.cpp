@@ -21,6 +21,9 @@
 #include <sstream>
 #include <stdexcept>
 #include <cmath>
+#include <thread>
+#include <exception>
+#include <limits>
 
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/interprocess/containers/vector.hpp>
@@ -41,45 +44,428 @@ bool compare_edgecoord(edgecoord e1, edgecoord e2)
         return (e1.pos<e2.pos);
 }
 
-//    Constructor. Initialize the pointers as nullptrs
-DrcSl::DrcSl()
+//    Append the spans of several buckets to the pending edges, in the order of the buckets.
+void SparseRows::push(std::vector<std::vector<EdgeSpan>> &buckets)
 {
-    this->lver = nullptr;
-    this->lhor = nullptr;
+    size_t total = pending.size();
+    for(std::vector<EdgeSpan> &b : buckets)
+        total += b.size();
+    pending.reserve(total);
+    for(std::vector<EdgeSpan> &b : buckets)
+        pending.insert(pending.end(),b.begin(),b.end());
 }
 
-//    Destructor: Delete the allocated vectors.
-DrcSl::~DrcSl()
+//    Sort the pending edges into the runs. The scanlines are split into runs at every start and end of an existing run
+//    or a pending edge, so that each new run is a set of identical scanlines. The edges are first counted per run and
+//    then filled in. Edges of the same scanline keep the order in which they were pushed.
+void SparseRows::commit()
+{
+    commit([](int n, const std::function<void(int)> &fn)
+    {
+        for(int i = 0; i < n; i++)
+            fn(i);
+    },1);
+}
+
+//    Same as commit(), with the pending edges split into nchunks chunks which are counted and filled in through pfor.
+//    Every chunk counts its edges per new run, so it knows where in each run its edges start and the edges of the chunks
+//    end up in the order in which they were pushed. The edges of the existing runs are counted and filled in by the first chunk.
+void SparseRows::commit(const ParallelFor &pfor, int nchunks)
 {
-    if(this->lhor != nullptr)
-        delete[] this->lhor;
-    if(this->lver != nullptr)
-        delete[] this->lver;
+    if(pending.empty())
+        return;
+
+    std::vector<int> bp;
+    bp.reserve(2 * (ind.size() + pending.size()));
+    for(size_t k = 0; k < ind.size(); k++)
+    {
+        bp.push_back(ind[k]);
+        bp.push_back(ind[k] + len[k]);
+    }
+    for(EdgeSpan &sp : pending)
+    {
+        bp.push_back(sp.lo);
+        bp.push_back(sp.hi);
+    }
+    std::sort(bp.begin(),bp.end());
+    bp.erase(std::unique(bp.begin(),bp.end()),bp.end());
+
+    //  An edge from lo to hi-1 goes into the runs seg(lo) up to the one starting at hi. The first run of every pending
+    //  edge is looked up once and kept for filling in.
+    auto seg = [&bp](int i) -> size_t
+    {
+        return std::lower_bound(bp.begin(),bp.end(),i) - bp.begin();
+    };
+    size_t nspans = pending.size();
+    std::vector<size_t> first(nspans);
+    std::vector<std::vector<size_t>> cnt(nchunks,std::vector<size_t>(bp.size(),0));
+
+    pfor(nchunks,[&](int c)
+    {
+        std::vector<size_t> &cc = cnt[c];
+        if(c == 0)
+        {
+            for(size_t k = 0; k < ind.size(); k++)
+            {
+                size_t n = off[k+1] - off[k];
+                for(size_t j = seg(ind[k]); bp[j] < ind[k] + len[k]; j++)
+                    cc[j] += n;
+            }
+        }
+        for(size_t s = nspans * c / nchunks; s < nspans * (c+1) / nchunks; s++)
+        {
+            size_t j = seg(pending[s].lo);
+            first[s] = j;
+            for(; bp[j] < pending[s].hi; j++)
+                cc[j]++;
+        }
+    });
+
+    std::vector<int> nind;
+    std::vector<int> nlen;
+    std::vector<size_t> noff(1,0);
+    for(size_t j = 0; j + 1 < bp.size(); j++)
+    {
+        size_t n = noff.back();
+        for(int c = 0; c < nchunks; c++)
+        {
+            size_t m = cnt[c][j];
+            cnt[c][j] = n;
+            n += m;
+        }
+        if(n == noff.back())
+            continue;
+        nind.push_back(bp[j]);
+        nlen.push_back(bp[j+1] - bp[j]);
+        noff.push_back(n);
+    }
+
+    std::vector<edgecoord> nedges(noff.back(),edgecoord(0,0));
+    pfor(nchunks,[&](int c)
+    {
+        std::vector<size_t> &cc = cnt[c];
+        if(c == 0)
+        {
+            for(size_t k = 0; k < ind.size(); k++)
+            {
+                for(size_t j = seg(ind[k]); bp[j] < ind[k] + len[k]; j++)
+                {
+                    std::copy(begin(k),end(k),nedges.begin() + cc[j]);
+                    cc[j] += off[k+1] - off[k];
+                }
+            }
+        }
+        for(size_t s = nspans * c / nchunks; s < nspans * (c+1) / nchunks; s++)
+        {
+            for(size_t j = first[s]; bp[j] < pending[s].hi; j++)
+                nedges[cc[j]++] = pending[s].e;
+        }
+    });
+
+    ind.swap(nind);
+    len.swap(nlen);
+    off.swap(noff);
+    edges.swap(nedges);
+    rem.assign((edges.size() + 63) / 64, 0);
+    std::vector<EdgeSpan>().swap(pending);
+    coalesce();
 }
 
-//    Add a complete data-set. Currently not used and not exposed in the Python interface.
-int DrcSl::set_data(std::vector<edgecoord> *horlist)
+//    Remove all edges that are marked in the bitmask in one linear pass and drop runs that became empty.
+void SparseRows::compact()
 {
-    this->l = horlist;
-    return 0;
+    size_t w = 0;
+    size_t kw = 0;
+    size_t b = off[0];
+    for(size_t k = 0; k < ind.size(); k++)
+    {
+        size_t e = off[k+1];
+        size_t w0 = w;
+        for(size_t n = b; n < e; n++)
+        {
+            if(!marked(n))
+                edges[w++] = edges[n];
+        }
+        if(w > w0)
+        {
+            ind[kw] = ind[k];
+            len[kw] = len[k];
+            off[kw+1] = w;
+            kw++;
+        }
+        b = e;
+    }
+    ind.resize(kw);
+    len.resize(kw);
+    off.resize(kw+1);
+    edges.erase(edges.begin() + w,edges.end());
+    rem.assign((w + 63) / 64, 0);
+    coalesce();
 }
 
-//    Initialize the dimensions of the vector arrays and set pointers accordingly and dimension units.
-void DrcSl::initialize_list(int hor1,int hor2, int ver1, int ver2, int violation_space, int violation_width)
+//    Same as compact(), but the runs are split into nchunks chunks which are processed through pfor. The surviving edges
+//    of every run are counted first, so that each chunk knows where to write its edges into the new array.
+void SparseRows::compact(const ParallelFor &pfor, int nchunks)
+{
+    std::vector<size_t> bounds = split(nchunks);
+    int n = bounds.size() - 1;
+
+    std::vector<size_t> noff(ind.size() + 1,0);
+    pfor(n,[this,&bounds,&noff](int c)
+    {
+        for(size_t k = bounds[c]; k < bounds[c+1]; k++)
+        {
+            size_t cnt = 0;
+            for(size_t e = off[k]; e < off[k+1]; e++)
+                cnt += !marked(e);
+            noff[k+1] = cnt;
+        }
+    });
+    for(size_t k = 0; k < ind.size(); k++)
+        noff[k+1] += noff[k];
+
+    std::vector<edgecoord> nedges(noff.back(),edgecoord(0,0));
+    pfor(n,[this,&bounds,&noff,&nedges](int c)
+    {
+        for(size_t k = bounds[c]; k < bounds[c+1]; k++)
+        {
+            size_t w = noff[k];
+            for(size_t e = off[k]; e < off[k+1]; e++)
+            {
+                if(!marked(e))
+                    nedges[w++] = edges[e];
+            }
+        }
+    });
+
+    size_t kw = 0;
+    for(size_t k = 0; k < ind.size(); k++)
+    {
+        if(noff[k+1] > noff[k])
+        {
+            ind[kw] = ind[k];
+            len[kw] = len[k];
+            off[kw+1] = noff[k+1];
+            kw++;
+        }
+    }
+    ind.resize(kw);
+    len.resize(kw);
+    off.resize(kw+1);
+    edges.swap(nedges);
+    rem.assign((edges.size() + 63) / 64, 0);
+    coalesce();
+}
+
+//    Merge neighbouring runs that carry identical edges, e.g. after cleaning removed the only difference between them.
+void SparseRows::coalesce()
+{
+    if(ind.empty())
+        return;
+
+    size_t kw = 0;
+    size_t w = off[1];
+    size_t b = off[1];
+    for(size_t k = 1; k < ind.size(); k++)
+    {
+        size_t e = off[k+1];
+        if(ind[kw] + len[kw] == ind[k] && e - b == w - off[kw] &&
+                std::equal(edges.begin() + b,edges.begin() + e,edges.begin() + off[kw],[](const edgecoord &e1, const edgecoord &e2)
+        {
+            return e1.pos == e2.pos && e1.type == e2.type;
+        }))
+        {
+            len[kw] += len[k];
+        }
+        else
+        {
+            kw++;
+            ind[kw] = ind[k];
+            len[kw] = len[k];
+            if(w != b)
+                std::copy(edges.begin() + b,edges.begin() + e,edges.begin() + w);
+            w += e - b;
+            off[kw+1] = w;
+        }
+        b = e;
+    }
+    ind.resize(kw+1);
+    len.resize(kw+1);
+    off.resize(kw+2);
+    edges.erase(edges.begin() + w,edges.end());
+    rem.assign((w + 63) / 64, 0);
+}
+
+//    Find the run which contains scanline i. Returns size() if the scanline does not carry any edges.
+size_t SparseRows::find(int i) const
+{
+    std::vector<int>::const_iterator it = std::upper_bound(ind.begin(),ind.end(),i);
+    if(it == ind.begin())
+        return ind.size();
+    size_t k = it - ind.begin() - 1;
+    if(i >= ind[k] + len[k])
+        return ind.size();
+    return k;
+}
+
+//    Split the runs into at most n chunks of consecutive runs with about the same number of edges each. Returns the first
+//    run of every chunk followed by size(). A run is never split, so there can be fewer chunks than requested.
+std::vector<size_t> SparseRows::split(int n) const
+{
+    std::vector<size_t> bounds(1,0);
+    size_t k = 0;
+    for(int c = 1; c < n; c++)
+    {
+        size_t target = edges.size() * c / n;
+        while(k < ind.size() && off[k] < target)
+            k++;
+        if(k > bounds.back() && k < ind.size())
+            bounds.push_back(k);
+    }
+    bounds.push_back(ind.size());
+    return bounds;
+}
+
+//    Find the scanlines in which the two stores differ, either in their edges or because only one of them has edges there.
+//    The differences are appended to out as ranges like the ones of DirtyRows.
+void SparseRows::diff(const SparseRows &other, std::vector<int> &out) const
+{
+    size_t a = 0;
+    size_t b = 0;
+    int y = std::numeric_limits<int>::min();
+    while(a < size() || b < other.size())
+    {
+        //  The next scanline that carries edges in either store and the end of the section in which neither changes.
+        int ya = a < size() ? std::max(ind[a],y) : std::numeric_limits<int>::max();
+        int yb = b < other.size() ? std::max(other.ind[b],y) : std::numeric_limits<int>::max();
+        y = std::min(ya,yb);
+        bool ina = a < size() && ind[a] <= y;
+        bool inb = b < other.size() && other.ind[b] <= y;
+        int e = std::numeric_limits<int>::max();
+        if(a < size())
+            e = std::min(e,ina ? ind[a] + len[a] : ind[a]);
+        if(b < other.size())
+            e = std::min(e,inb ? other.ind[b] + other.len[b] : other.ind[b]);
+
+        bool same = ina && inb && off[a+1] - off[a] == other.off[b+1] - other.off[b] &&
+                    std::equal(edges.begin() + off[a],edges.begin() + off[a+1],other.edges.begin() + other.off[b],
+                               [](const edgecoord &e1, const edgecoord &e2)
+        {
+            return e1.pos == e2.pos && e1.type == e2.type;
+        });
+        if(!same)
+        {
+            if(!out.empty() && out.back() >= y)
+                out.back() = std::max(out.back(),e);
+            else
+            {
+                out.push_back(y);
+                out.push_back(e);
+            }
+        }
+        if(ina && ind[a] + len[a] == e)
+            a++;
+        if(inb && other.ind[b] + other.len[b] == e)
+            b++;
+        y = e;
+    }
+}
+
+//    Add the ranges of scanlines in rows, which have to be sorted and must not overlap, and merge them with the ones
+//    already stored.
+void DirtyRows::add(const std::vector<int> &rows)
 {
-    if(this->lhor)
+    if(all || rows.empty())
+        return;
+    std::vector<int> merged;
+    merged.reserve(ranges.size() + rows.size());
+    size_t i = 0;
+    size_t j = 0;
+    while(i < ranges.size() || j < rows.size())
     {
-        delete[] this->lhor;
-        this->lhor = nullptr;
+        const int *r;
+        if(j == rows.size() || (i < ranges.size() && ranges[i] < rows[j]))
+        {
+            r = &ranges[i];
+            i += 2;
+        }
+        else
+        {
+            r = &rows[j];
+            j += 2;
+        }
+        if(!merged.empty() && merged.back() >= r[0])
+            merged.back() = std::max(merged.back(),r[1]);
+        else
+        {
+            merged.push_back(r[0]);
+            merged.push_back(r[1]);
+        }
     }
-    if(this->lver)
+    ranges.swap(merged);
+}
+
+//    Number of scanlines in the ranges. Only meaningful if all is not set.
+size_t DirtyRows::count() const
+{
+    size_t n = 0;
+    for(size_t i = 0; i < ranges.size(); i += 2)
+        n += ranges[i+1] - ranges[i];
+    return n;
+}
+
+//    Constructor. Start in row orientation.
+DrcSl::DrcSl()
+{
+    this->l = &this->lhor;
+}
+
+//    Copy constructor and assignment. The active scanlines have to point to the copy's own storage.
+DrcSl::DrcSl(const DrcSl &other)
+{
+    *this = other;
+}
+
+DrcSl& DrcSl::operator=(const DrcSl &other)
+{
+    this->violation_width = other.violation_width;
+    this->violation_space = other.violation_space;
+    this->hor1 = other.hor1;
+    this->hor2 = other.hor2;
+    this->ver1 = other.ver1;
+    this->ver2 = other.ver2;
+    this->orientation = other.orientation;
+    this->lhor = other.lhor;
+    this->lver = other.lver;
+    this->l = this->orientation ? &this->lver : &this->lhor;
+    this->shor = other.shor;
+    this->sver = other.sver;
+    this->count_lo = other.count_lo;
+    this->count_hi = other.count_hi;
+    this->nthreads = other.nthreads;
+    this->pfor = other.pfor;
+    for(int o = 0; o < 2; o++)
     {
-        delete[] this->lver;
-        this->lver = nullptr;
+        this->dirty_space[o] = other.dirty_space[o];
+        this->dirty_width[o] = other.dirty_width[o];
+        this->dirty_switch[o] = other.dirty_switch[o];
+        this->transposed[o] = other.transposed[o];
     }
-    this->lhor = new std::vector<edgecoord>[ver2-ver1+5];
-    this->lver = new std::vector<edgecoord>[hor2-hor1+5];
-    this->l = this->lhor;
+    return *this;
+}
+
+//    Destructor. The sparse rows clean up after themselves.
+DrcSl::~DrcSl()
+{
+}
+
+//    Initialize the dimensions of the scanlines and dimension units. No memory is allocated for the scanlines
+//    until edges are added to them.
+void DrcSl::initialize_list(int hor1,int hor2, int ver1, int ver2, int violation_space, int violation_width)
+{
+    this->lhor.clear();
+    this->lver.clear();
+    this->l = &this->lhor;
     this->sver = hor2-hor1+5;
     this->shor = ver2-ver1+5;
     this->hor1 = hor1-2;
@@ -89,6 +475,11 @@ void DrcSl::initialize_list(int hor1,int hor2, int ver1, int ver2, int violation
     this->violation_space = violation_space;
     this->violation_width = violation_width;
     this->orientation = hor;
+    this->count_lo = this->ver1;
+    this->count_hi = this->ver2 + 1;
+    this->transposed[hor].clear();
+    this->transposed[ver].clear();
+    invalidate();
 }
 
 //    Print the complete data set or from index beg -> end if they are set.
@@ -100,17 +491,20 @@ void DrcSl::printvector(int beg, int last)
         last = this->orientation ? this->ver2 : this->hor2;
         beg = this->orientation ? this->ver1 : this->hor1;
     }
-    std::vector<edgecoord>::iterator it;
+    edgecoord *it;
+
+    this->l->commit();
 
     std::cout << "size, y: " << this->sver << std::endl << "size, x: " << this->shor << std::endl;
     int offset = this->orientation ? -this-> hor1 : -this-> ver1;
     int offset_d2 = this->orientation ? -this->ver1 : -this-> hor1;
     std::cout << "beg/end " << beg+offset << '/' << last+offset-1 << std::endl;
 
-    for (int i = 0; i < this->s(); i++)
+    for (size_t k = 0; k < this->l->size(); k++)
     {
-        std::cout << "row: " << i-offset << ": [";
-        for(it = this->l[i].begin(); it != this->l[i].end(); it++)
+        int i = this->l->ind[k];
+        std::cout << "rows: " << i-offset << "-" << i-offset+this->l->len[k]-1 << ": [";
+        for(it = this->l->begin(k); it != this->l->end(k); it++)
         {
             std::cout << "(" << it->pos -offset_d2<< "," << it->type << ")";
         }
@@ -125,44 +519,240 @@ int DrcSl::s()
 }
 
 
+//    Use nthreads threads for ingestion and the row-local kernels (sorting, space and width passes). The threads are
+//    started for each kernel, use the overload below to run the kernels on an existing thread pool instead.
+void DrcSl::set_threads(int nthreads)
+{
+    set_threads(nthreads,[](int n, const std::function<void(int)> &fn)
+    {
+        std::vector<std::exception_ptr> errors(n);
+        auto job = [&fn,&errors](int i)
+        {
+            try
+            {
+                fn(i);
+            }
+            catch(...)
+            {
+                errors[i] = std::current_exception();
+            }
+        };
+        std::vector<std::thread> threads;
+        for(int i = 1; i < n; i++)
+        {
+            threads.emplace_back(job,i);
+        }
+        job(0);
+        for(std::thread &t : threads)
+        {
+            t.join();
+        }
+        for(std::exception_ptr &e : errors)
+        {
+            if(e)
+                std::rethrow_exception(e);
+        }
+    });
+}
+
+//    Use nthreads chunks for ingestion and the row-local kernels, which are processed through pfor.
+void DrcSl::set_threads(int nthreads, const ParallelFor &pfor)
+{
+    this->nthreads = std::max(1,nthreads);
+    this->pfor = pfor;
+}
+
+//    Number of chunks to process nedges edges in. Small data sets are not split, starting the threads would take longer.
+int DrcSl::chunks(size_t nedges)
+{
+    if(this->nthreads < 2 || !this->pfor)
+        return 1;
+    return (int)std::max<size_t>(1,std::min<size_t>(this->nthreads,nedges / parallel_min_edges));
+}
+
+//    Sort the pending edges of rows into its runs, in chunks if there are many of them.
+void DrcSl::commit(SparseRows *rows)
+{
+    int n = chunks(rows->pending.size());
+    if(n > 1)
+        rows->commit(this->pfor,n);
+    else
+        rows->commit();
+}
+
+//    Run fn(0) to fn(n-1), on the calling thread if there is only one of them.
+void DrcSl::run(int n, const std::function<void(int)> &fn)
+{
+    if(n == 1)
+        fn(0);
+    else
+        this->pfor(n,fn);
+}
+
+//    Run kernel(k0,k1,marker) on chunks of runs k0 to k1-1 of the current scanlines and return the sum of its results.
+//    The kernel marks edges for removal only through the marker of its chunk, so the chunks can be processed
+//    concurrently. The marked edges are removed once all chunks are done.
+//    If dirty is set, only the runs in the scanlines it holds are visited and it is reset afterwards. This is meant for
+//    passes which leave no violations of their rule behind, so the scanlines which did not change since the last pass
+//    are clean. Visiting them anyway gives the same result, which is done if many scanlines changed and the runs are
+//    split into chunks of equal size.
+template<class Kernel>
+int DrcSl::for_runs(Kernel kernel, DirtyRows *dirty)
+{
+    std::vector<size_t> sel;
+    size_t nsel = 0;
+    if(dirty && !dirty->all)
+    {
+        size_t k = 0;
+        for(size_t i = 0; i < dirty->ranges.size(); i += 2)
+        {
+            int lo = dirty->ranges[i];
+            int hi = dirty->ranges[i+1];
+            size_t k0 = std::upper_bound(this->l->ind.begin() + k,this->l->ind.end(),lo) - this->l->ind.begin();
+            if(k0 > k && this->l->ind[k0-1] + this->l->len[k0-1] > lo)
+                k0--;
+            k = k0;
+            while(k < this->l->size() && this->l->ind[k] < hi)
+                k++;
+            if(k == k0)
+                continue;
+            if(!sel.empty() && sel.back() == k0)
+                sel.back() = k;
+            else
+            {
+                sel.push_back(k0);
+                sel.push_back(k);
+            }
+            nsel += this->l->off[k] - this->l->off[k0];
+        }
+    }
+
+    //  Every chunk visits the runs parts[c][2i] to parts[c][2i+1]-1.
+    std::vector<std::vector<size_t>> parts;
+    if(dirty && !dirty->all && chunks(nsel) < 2)
+    {
+        if(!sel.empty())
+            parts.push_back(sel);
+    }
+    else
+    {
+        std::vector<size_t> bounds = this->l->split(chunks(this->l->edges.size()));
+        for(size_t c = 0; c + 1 < bounds.size(); c++)
+            parts.push_back({bounds[c],bounds[c+1]});
+    }
+    int n = parts.size();
+    if(n == 0)
+    {
+        dirty->reset();
+        return 0;
+    }
+
+    std::vector<SparseRows::Marker> markers;
+    markers.reserve(n);
+    for(int c = 0; c < n; c++)
+    {
+        markers.emplace_back(*this->l,parts[c].front(),parts[c].back());
+    }
+    std::vector<int> res(n,0);
+    run(n,[&kernel,&parts,&markers,&res](int c)
+    {
+        for(size_t i = 0; i < parts[c].size(); i += 2)
+            res[c] += kernel(parts[c][i],parts[c][i+1],markers[c]);
+    });
+
+    bool er = false;
+    int sum = 0;
+    std::vector<int> rows;
+    for(int c = 0; c < n; c++)
+    {
+        markers[c].flush();
+        er = er || markers[c].any;
+        sum += res[c];
+        for(size_t k : markers[c].runs)
+        {
+            int lo = this->l->ind[k];
+            if(!rows.empty() && rows.back() == lo)
+                rows.back() = lo + this->l->len[k];
+            else
+            {
+                rows.push_back(lo);
+                rows.push_back(lo + this->l->len[k]);
+            }
+        }
+    }
+    if (er)
+    {
+        if (n > 1)
+            this->l->compact(this->pfor,n);
+        else
+            this->l->compact();
+    }
+    if(dirty)
+    {
+        dirty->reset();
+        changed(this->orientation,rows);
+    }
+    return sum;
+}
+
+//    Record that the scanlines in rows of orientation o changed, so that the following passes in o revisit them.
+void DrcSl::changed(int o, const std::vector<int> &rows)
+{
+    this->dirty_space[o].add(rows);
+    this->dirty_width[o].add(rows);
+    this->dirty_switch[o].add(rows);
+}
+
+//    Forget which scanlines changed, all of them are revisited by the following passes.
+void DrcSl::invalidate()
+{
+    for(int o = 0; o < 2; o++)
+    {
+        this->dirty_space[o] = DirtyRows();
+        this->dirty_width[o] = DirtyRows();
+        this->dirty_switch[o] = DirtyRows();
+    }
+}
+
+//    Sort edges added since the last pass into the scanlines. They can go anywhere, so all scanlines are revisited.
+void DrcSl::sync()
+{
+    if(this->l->pending.empty())
+        return;
+    commit(this->l);
+    invalidate();
+}
+
 //  Sort all data with compare_edge_coord and remove overlapping edges, i.e. merge overlapping polygons in the data
 void DrcSl::sortlist()
 {
-//        std::cout << this->s() << std::endl;
-    for (int i = 0; i < this->s(); i++)
+    commit(this->l);
+    for_runs([this](size_t k0, size_t k1, SparseRows::Marker &m)
     {
-        if (!this->l[i].empty())
+        for (size_t k = k0; k < k1; k++)
         {
-            std::sort(this->l[i].begin(),this->l[i].end(),compare_edgecoord);
-            std::vector<edgecoord>::iterator it;
-            it = this->l[i].begin();
+            std::sort(this->l->begin(k),this->l->end(k),compare_edgecoord);
+            edgecoord *it = this->l->begin(k);
             int c = 0;
-            for(; it != this->l[i].end(); it++)
+            for(; it != this->l->end(k); it++)
             {
                 if (it->type == 0)
                 {
                     c++;
                     if (c>1 || c<0)
-                    {
-                        it->rem = true;
-                    }
+                        m.mark(k,it);
                 }
                 else
                 {
                     if (c>1 || c<0)
-                    {
-                        it->rem = true;
-                    }
+                        m.mark(k,it);
                     c--;
                 }
             }
-            this->l[i].erase(std::remove_if(this->l[i].begin(),this->l[i].end(),[](auto o)
-            {
-                return o.rem;
-            }),this->l[i].end());
-
         }
-    }
+        return 0;
+    });
+    invalidate();
 }
 
 //    Get data from a row (or column).
@@ -173,10 +763,15 @@ std::vector<int> DrcSl::get_vect(int ind)
     int offset = this->orientation ? -this->hor1 : -this-> ver1;
     int offset_d2 = this->orientation ? -this->ver1 : -this-> hor1;
 
-    std::vector<int> res = std::vector<int>(this->l[ind+offset].size());
-    std::vector<edgecoord>::iterator it;
+    this->l->commit();
+    size_t k = this->l->find(ind+offset);
+    if(k == this->l->size())
+        return std::vector<int>();
+
+    std::vector<int> res = std::vector<int>(this->l->end(k) - this->l->begin(k));
+    edgecoord *it;
     int i;
-    for(it = this->l[ind+offset].begin(),i=0; it !=this->l[ind+offset].end(); it++,i++)
+    for(it = this->l->begin(k),i=0; it !=this->l->end(k); it++,i++)
     {
         if (it->type)
             res[i]=(it->pos-1-offset_d2);
@@ -194,10 +789,15 @@ std::vector<int> DrcSl::get_types(int ind)
 
     offset ++;
 
-    std::vector<int> res = std::vector<int>(this->l[ind+offset].size());
-    std::vector<edgecoord>::iterator it;
+    this->l->commit();
+    size_t k = this->l->find(ind+offset);
+    if(k == this->l->size())
+        return std::vector<int>();
+
+    std::vector<int> res = std::vector<int>(this->l->end(k) - this->l->begin(k));
+    edgecoord *it;
     int i;
-    for(it = this->l[ind+offset].begin(),i=0; it !=this->l[ind+offset].end(); it++,i++)
+    for(it = this->l->begin(k),i=0; it !=this->l->end(k); it++,i++)
     {
         res[i] = it->type;
     }
@@ -208,88 +808,159 @@ std::vector<int> DrcSl::get_types(int ind)
 //    Add data to the data structure. We manhattanize the edge from the input and mark left facing edges with -1 and
 //    right facing edges with +1. The get_vect() function reverses this effect.
 //    This should have no influence on any possible data except that it merges touching polygons.
+//    Consecutive scanlines on which the edge has the same position are pushed as one span, so a vertical edge is a single span.
 void DrcSl::add_data(int px1, int px2, int py1, int py2)
 {
+    rasterise(px1,px2,py1,py2,this->l->pending);
+}
+
+//    Add n edges stored as x1,x2,y1,y2 one after another, see add_data(). Large inputs are rasterised in chunks in
+//    parallel. The spans of the chunks are appended in input order, so the result is the same as adding the edges one by one.
+void DrcSl::add_edges(const int *edges, size_t n)
+{
+    int nchunks = chunks(n);
+    if(nchunks == 1)
+    {
+        for(size_t i = 0; i < n; i++)
+            rasterise(edges[4*i],edges[4*i+1],edges[4*i+2],edges[4*i+3],this->l->pending);
+        return;
+    }
+
+    std::vector<std::vector<EdgeSpan>> buckets(nchunks);
+    run(nchunks,[this,edges,n,nchunks,&buckets](int c)
+    {
+        for(size_t i = n * c / nchunks; i < n * (c+1) / nchunks; i++)
+            rasterise(edges[4*i],edges[4*i+1],edges[4*i+2],edges[4*i+3],buckets[c]);
+    });
+
+    this->l->push(buckets);
+}
+
+//    Add a closed contour of n points stored as x,y one after another. The last point is connected to the first one.
+//    The bounding box of the contour is checked once instead of every edge.
+void DrcSl::add_polygon(const int *points, size_t n)
+{
+    if(n < 2)
+        return;
+
+    int xmin = points[0];
+    int xmax = points[0];
+    int ymin = points[1];
+    int ymax = points[1];
+    for(size_t j = 1; j < n; j++)
+    {
+        xmin = std::min(xmin,points[2*j]);
+        xmax = std::max(xmax,points[2*j]);
+        ymin = std::min(ymin,points[2*j+1]);
+        ymax = std::max(ymax,points[2*j+1]);
+    }
     int offset = this->orientation ? -this-> hor1 : -this-> ver1;
     int offset_d2 = this->orientation ? -this->ver1 : -this-> hor1;
-
-    if (py2 > py1)
+    if (xmin+offset_d2-1 < 0 || xmax+offset_d2+1 > (this->orientation ? this->shor : this->sver))
+    {
+        std::cout << "Error ROW (y) index out of bound " << xmin << '/' << xmax << std::endl;
+        throw 1;
+    }
+    if (ymin+offset < 0 || ymax+offset > this->s())
     {
-        edgecoord p  = edgecoord(px1+offset_d2-1,0);
+        std::cout << "Error COLUMN (x) index out of bound" << ymin << '/' << ymax << std::endl;
+        throw 2;
+    }
 
-        double dx = (double)(px2-px1)/(py2-py1);
-        double x = p.pos;
-        if (p.pos < 0 || p.pos > (this->orientation ? this->shor : this->sver))
-        {
-            std::cout << "Error ROW (y) index out of bound " << p.pos << '/' << (this->orientation ? this->shor: this->sver) << std::endl;
-            throw 1;
-        }
-        if (offset+py1 < 0 || py2+offset > (this->orientation ? this->sver : this->shor))
-        {
-            std::cout << "Error COLUMN (x) index out of bound" << py2+offset << "/" << this->s() << std::endl;
-            throw 2;
-        }
+    for(size_t j = 0; j < n; j++)
+    {
+        size_t k = j + 1 < n ? j + 1 : 0;
+        scan_edge(points[2*j],points[2*k],points[2*j+1],points[2*k+1],this->l->pending);
+    }
+}
 
-        if (dx > 0)
-        {
-            for(int i = offset+py1; i < py2+offset; i++)
-            {
-                this->l[i].push_back(p);
-                x+=dx;
-                p.pos = int(x);
-            }
-        }
-        else
-        {
-            for(int i = offset+py1; i < py2+offset-1; i++)
-            {
-                x+=dx;
-                p.pos = int(x);
-                this->l[i].push_back(p);
-            }
-            p.pos = px2+offset_d2-1;
-            this->l[py2+offset-1].push_back(p);
-        }
+//    Check that the edge from px1,py1 to px2,py2 lies within the scanlines, then manhattanize it into bucket.
+void DrcSl::rasterise(int px1, int px2, int py1, int py2, std::vector<EdgeSpan> &bucket)
+{
+    if (py1 == py2)
+        return;
 
+    int offset = this->orientation ? -this-> hor1 : -this-> ver1;
+    int offset_d2 = this->orientation ? -this->ver1 : -this-> hor1;
+    int pos = py2 > py1 ? px1+offset_d2-1 : px2+offset_d2+1;
+    if (pos < 0 || pos > (this->orientation ? this->shor : this->sver))
+    {
+        std::cout << "Error ROW (y) index out of bound " << pos << '/' << (this->orientation ? this->shor: this->sver) << std::endl;
+        throw 1;
     }
-    else if (py1 > py2)
+    if (std::min(py1,py2)+offset < 0 || std::max(py1,py2)+offset > this->s())
     {
-        edgecoord p  = edgecoord(px2+offset_d2+1,1);
+        std::cout << "Error COLUMN (x) index out of bound" << std::max(py1,py2)+offset << "/" << this->s() << std::endl;
+        throw 2;
+    }
+    scan_edge(px1,px2,py1,py2,bucket);
+}
 
-        double dx = (double)(px1-px2)/(py1-py2);
-        double x = p.pos;
-        if (p.pos < 0 || p.pos > (this->orientation ? this->shor : this->sver))
-        {
-            std::cout << "Error ROW (y) index out of bound " << p.pos << '/' << (this->orientation ? this->shor: this->sver) << std::endl;
-            throw 1;
-        }
-        if (offset+py1 < 0 || py2+offset > this->s())
-        {
-            std::cout << "Error COLUMN (x) index out of bound" << std::endl;
-            throw 2;
-        }
+//    Manhattanize the edge from px1,py1 to px2,py2 and append its spans to bucket. Upward edges are left edges stored one
+//    left of the polygon, downward edges are right edges stored one right of it. On every scanline the edge is placed
+//    where it is furthest outside of the polygon, i.e. at the bottom or the top of the scanline, rounded outwards.
+//    The position is stepped with integer quotient and remainder like in Bresenham's algorithm, so even very long edges
+//    end exactly on their end point. The scanlines are visited in ascending order.
+void DrcSl::scan_edge(int px1, int px2, int py1, int py2, std::vector<EdgeSpan> &bucket)
+{
+    if (py1 == py2)
+        return;
 
-        if (dx < 0)
+    int offset = this->orientation ? -this-> hor1 : -this-> ver1;
+    int offset_d2 = this->orientation ? -this->ver1 : -this-> hor1;
+
+    bool up = py2 > py1;
+    edgecoord p = up ? edgecoord(px1+offset_d2-1,0) : edgecoord(px2+offset_d2+1,1);
+    int x0 = p.pos;
+    int i0 = offset + (up ? py1 : py2);
+    long long dx = up ? (long long)px2-px1 : (long long)px1-px2;
+    long long dy = up ? (long long)py2-py1 : (long long)py1-py2;
+
+    //  On scanline m the edge is at x0 + (m+c)*dx/dy, where c selects the bottom (0) or top (1) of the scanline.
+    //  q and r are the quotient rounded down and the remainder of (m+c)*dx/dy, qs and rs those of the step dx/dy.
+    long long c = (up ? dx > 0 : dx < 0) ? 0 : 1;
+    auto floordiv = [](long long a, long long b)
+    {
+        return a >= 0 ? a / b : -((-a + b - 1) / b);
+    };
+    long long q = floordiv(c*dx,dy);
+    long long r = c*dx - q*dy;
+    long long qs = floordiv(dx,dy);
+    long long rs = dx - qs*dy;
+
+    int span_lo = i0;
+    int span_hi = i0;
+    p.pos = x0 + (int)(up || r == 0 ? q : q+1);
+    for (int i = i0; i < i0 + dy; i++)
+    {
+        int pos = x0 + (int)(up || r == 0 ? q : q+1);
+        if (pos != p.pos)
         {
-            for(int i = offset+py2; i < py1+offset; i++)
-            {
-                this->l[i].push_back(p);
-                x+=dx;
-                p.pos = std::ceil(x);
-            }
+            bucket.emplace_back(span_lo,span_hi,p);
+            span_lo = i;
+            p.pos = pos;
         }
-        else
+        span_hi = i+1;
+        q += qs;
+        r += rs;
+        if (r >= dy)
         {
-            for(int i = offset+py2; i < py1+offset-1; i++)
-            {
-                x+=dx;
-                p.pos = std::ceil(x);
-                this->l[i].push_back(p);
-            }
-            p.pos = px1+offset_d2+1;
-            this->l[py1+offset-1].push_back(p);
+            q++;
+            r -= dy;
         }
     }
+    bucket.emplace_back(span_lo,span_hi,p);
+}
+
+//    Number of scanlines of run k on which a violation at position pos is counted. A violation is only counted
+//    if it lies in the rows count_lo to count_hi-1, which are all rows unless this cleaner is a band of a larger layer.
+int DrcSl::weight(size_t k, int pos)
+{
+    int lo = this->count_lo - this->ver1;
+    int hi = this->count_hi - this->ver1;
+    if (this->orientation)
+        return (pos >= lo && pos < hi) ? this->l->len[k] : 0;
+    return std::max(0,std::min(this->l->ind[k] + this->l->len[k],hi) - std::max(this->l->ind[k],lo));
 }
 
 //    Clean data for space violations in the current orientation (row-oriented for violations within the row and accordingly if column-oriented).
@@ -297,45 +968,34 @@ int DrcSl::clean_space()
 {
     //Cleans space violations.
     //Returns number of space violations that were cleaned.
-    std::vector<edgecoord> *il = this->l;
-
-    //Counters to keep track of how many checks were done and how many space violations have been cleaned.
-    int spacevios = 0;
-    int counts = 0;
+    sync();
 
-    std::vector<edgecoord>::iterator it;
-
-    for (int i = 0; i<this->s(); i++)
+    //Counter to keep track of how many space violations have been cleaned, summed over the chunks of runs.
+    int spacevios = for_runs([this](size_t k0, size_t k1, SparseRows::Marker &m)
     {
-        if (!il->empty())
+        int vios = 0;
+        edgecoord *it;
+        for (size_t k = k0; k < k1; k++)
         {
-            bool er = false;
-            it = il->begin();
-            if (it == il->end())
+            edgecoord *last = this->l->end(k);
+            it = this->l->begin(k);
+            if (it == last)
                 continue;
             it++;
-            while(it+1 != il->end())
+            while(it+1 != last)
             {
-                counts++;
                 if ((it+1)->pos - it->pos < violation_space -1)
                 {
-                    er = true;
-                    spacevios++;
-                    it->rem = true;
-                    (it+1)->rem = true;
+                    vios += weight(k,it->pos);
+                    m.mark(k,it);
+                    m.mark(k,it+1);
                 }
                 it+=2;
             }
-            if (er)
-                il->erase(std::remove_if(il->begin(),il->end(),[](auto o)
-            {
-                return o.rem;
-            }),il->end());
         }
-        il++;
-    }
-//        If progress output is desired uncomment the following lines
-//        std::cout << "number of checks: " << counts << std::endl;
+        return vios;
+    },&this->dirty_space[this->orientation]);
+//        If progress output is desired uncomment the following line
 //        std::cout << "violations, space: " << spacevios << std::endl;
     return spacevios;
 
@@ -344,42 +1004,30 @@ int DrcSl::clean_space()
 //    Clean data for width violation
 int DrcSl::clean_width()
 {
-    std::vector<edgecoord> *il = this->l;
+    sync();
 
-    int widthvios = 0;
-    int counts = 0;
-
-    std::vector<edgecoord>::iterator it;
-
-    for (int i = 0; i<this->s(); i++)
+    int widthvios = for_runs([this](size_t k0, size_t k1, SparseRows::Marker &m)
     {
-        if (!il->empty())
+        int vios = 0;
+        edgecoord *it;
+        for (size_t k = k0; k < k1; k++)
         {
-            bool er=false;
-            it = il->begin();
-            while(it != il->end())
+            edgecoord *last = this->l->end(k);
+            it = this->l->begin(k);
+            while(it != last)
             {
-                counts++;
                 if ((it+1)->pos - it->pos < violation_width +1)
                 {
-                    er = true;
-                    it->rem = true;
-                    (it+1)->rem = true;
-                    widthvios++;
+                    m.mark(k,it);
+                    m.mark(k,it+1);
+                    vios += weight(k,it->pos);
                 }
                 it+=2;
             }
-            if (er)
-                il->erase(std::remove_if(il->begin(),il->end(),[](auto o)
-            {
-                return o.rem;
-            }),il->end());
-
         }
-        il++;
-    }
-//        If progress output is desired uncomment the following lines
-//        std::cout << "number of checks: " << counts << std::endl;
+        return vios;
+    },&this->dirty_width[this->orientation]);
+//        If progress output is desired uncomment the following line
 //        std::cout << "violations, width: " << widthvios << std::endl;
     return widthvios;
 
@@ -387,11 +1035,11 @@ int DrcSl::clean_width()
 
 
 //    Calculate difference between two rows or two columns. This is necessary when switching from row-oriented to
-//    column-oriented data and vice-versa.
+//    column-oriented data and vice-versa. The differences are appended to out.
 //
 //    In theory this can also be used to check for minimum edge-lengths. But for us all of these requirements have been
 //    waived, so we don't have to check for those.
-std::vector<int> DrcSl::listdif(std::vector<edgecoord> &l1, std::vector<edgecoord> &l2)
+void DrcSl::listdif(const RowView &l1, const RowView &l2, std::vector<int> &out)
 {
     /*
     **  Calculates differences between rows (or columns, depending on orientation) between two vectors (rows/columns)
@@ -409,25 +1057,22 @@ std::vector<int> DrcSl::listdif(std::vector<edgecoord> &l1, std::vector<edgecoor
     **  out = ([1,3],[18,20])
     */
 
-    std::vector<int> out;
-    std::vector<edgecoord>::iterator it1 = l1.begin();
-    std::vector<edgecoord>::iterator it2 = l2.begin();
+    size_t i2 = 0;
     int l21;
     int l22;
-    for (it1 = l1.begin(); it1 !=l1.end(); it1++)
+    for (size_t i1 = 0; i1 < l1.size(); i1 += 2)
     {
-        int b = it1->pos;
-        it1++;
-        int e = it1->pos;
+        int b = l1.inner(i1);
+        int e = l1.inner(i1+1);
         int ee = e;
         bool add = true;
-        while(it2 != l2.end())
+        while(i2 < l2.size())
         {
-            l21 = it2->pos;
-            l22 = (it2+1)->pos;
+            l21 = l2.inner(i2);
+            l22 = l2.inner(i2+1);
             if(l22 < b)
             {
-                it2+=2;
+                i2+=2;
             }
             else if (l22 >= e)
             {
@@ -443,7 +1088,7 @@ std::vector<int> DrcSl::listdif(std::vector<edgecoord> &l1, std::vector<edgecoor
                 out.push_back(l21 -1);
                 b = l22 + 1;
                 e = ee;
-                it2 += 2;
+                i2 += 2;
             }
             else if (l22 >= b && b >= l21)
                 b = l22 + 1;
@@ -460,7 +1105,6 @@ std::vector<int> DrcSl::listdif(std::vector<edgecoord> &l1, std::vector<edgecoor
             out.push_back(e);
         }
     }
-    return out;
 }
 
 
@@ -499,102 +1143,247 @@ void DrcSl::switch_dimensions()
 
 //        If progress output is desired uncomment the following lines
 //        std::cout << "Switching dimensions" << std::endl;
-    if(this->lhor == nullptr)
-        this->lhor = new std::vector<edgecoord>[this->ver2-this->ver1];
-    if(this->lver == nullptr)
-        this->lver = new std::vector<edgecoord>[this->hor2-this->hor1];
-
-    std::vector<edgecoord> *l_new;
-
-    if (this->orientation)
+    sync();
+    int o = this->orientation;
+    int o_new = this->orientation ? hor : ver;
+    SparseRows *l_new = this->orientation ? &this->lhor : &this->lver;
+    SparseRows &dst = this->transposed[o];
+
+    //  Only the scanlines which changed since the last switch and the ones next to them transpose to other edges than
+    //  back then. If there are few of them, the result of the last switch is updated instead of transposing everything.
+    DirtyRows &dirty = this->dirty_switch[o];
+    if(!dirty.all && dirty.count() < this->l->size())
     {
-        for(int i = 0; i<this->shor; i++)
-        {
-            this->lhor[i].clear();
-        }
-        l_new = this->lhor;
+        transpose_changed(dirty,dst);
     }
     else
     {
-        for(int i = 0; i<this->sver; i++)
+        dst.clear();
+
+        //  Compare the scanlines of the runs k0 to k1-1 and the empty scanlines next to them to their neighbours and add
+        //  the differences to out. The scanlines from stop on are compared by the next chunk of runs.
+        auto transpose = [this](size_t k0, size_t k1, int stop, std::vector<EdgeSpan> &out)
+        {
+            std::vector<int> dif;
+            int last = -2;
+            //  The first scanline compared is two before run k0, which can only lie in one of the two runs before it.
+            size_t cur = k0 >= 2 ? k0 - 2 : 0;
+
+            auto visit = [&](int row_number)
+            {
+                if (row_number <= last || row_number >= stop || row_number < 1 || row_number > this->s() - 2)
+                    return;
+                last = row_number;
+                transpose_row(cur,row_number,dif,out);
+            };
+
+            //  Only the first and last scanline of a run and the empty scanlines right next to it can differ from their
+            //  neighbours. Inside of a run all three compared scanlines are identical, which only produces edges if listdif
+            //  does not cancel a scanline against itself (e.g. for crossed intervals at the tip of a manhattanized edge).
+            for (size_t k = k0; k < k1; k++)
+            {
+                int first = this->l->ind[k];
+                int end = first + this->l->len[k];
+                visit(first - 1);
+                visit(first);
+                if (end - first > 2)
+                {
+                    RowView self = RowView(this->l->begin(k),this->l->end(k));
+                    dif.clear();
+                    listdif(self,self,dif);
+                    if (!dif.empty())
+                    {
+                        for (int r = first + 1; r < end - 1; r++)
+                            visit(r);
+                    }
+                }
+                visit(end - 1);
+                visit(end);
+            }
+        };
+
+        //  The runs are transposed in chunks. A chunk stops at the first scanline the next chunk compares, so every scanline
+        //  is compared exactly once and the spans of the chunks are in the same order as if they were done one after another.
+        std::vector<size_t> bounds = this->l->split(chunks(this->l->edges.size()));
+        int n = bounds.size() - 1;
+        if (n == 1)
+        {
+            transpose(0,this->l->size(),this->s(),dst.pending);
+        }
+        else
         {
-            this->lver[i].clear();
+            std::vector<std::vector<EdgeSpan>> buckets(n);
+            run(n,[this,&transpose,&bounds,&buckets,n](int c)
+            {
+                int stop = c + 1 < n ? this->l->ind[bounds[c+1]] - 1 : this->s();
+                transpose(bounds[c],bounds[c+1],stop,buckets[c]);
+            });
+            dst.push(buckets);
         }
-        l_new = this->lver;
+        commit(&dst);
     }
-    std::vector<edgecoord> row_last;
-    std::vector<edgecoord> row;
-    std::vector<edgecoord> row_next;
-    std::vector<edgecoord> *it = this->l;
-    std::vector<int>::iterator dit;
-    std::vector<int> dif1;
-    std::vector<int> dif2;
-    std::vector<edgecoord>::iterator rit;
-    row_last = *it;
-    for(rit = row_last.begin(); rit != row_last.end(); rit++)
+    dirty.reset();
+
+    //  The scanlines of the new orientation changed where they differ from the ones it had before the last switch.
+    if(!this->dirty_space[o_new].all || !this->dirty_width[o_new].all || !this->dirty_switch[o_new].all)
     {
-        rit->pos++;
-        rit++;
-        rit->pos--;
+        std::vector<int> rows;
+        dst.diff(*l_new,rows);
+        changed(o_new,rows);
     }
-    it ++;
-    row = *it;
-    for(rit = row.begin(); rit != row.end(); rit++)
+    *l_new = dst;
+    this->l = l_new;
+    this->orientation = o_new;
+}
+
+//    View of scanline r. Scanlines are looked up in ascending order, so the run of r is searched from run k on.
+RowView DrcSl::view(size_t &k, int r)
+{
+    while(k < this->l->size() && this->l->ind[k] + this->l->len[k] <= r)
+        k++;
+    if(k == this->l->size() || this->l->ind[k] > r)
+        return RowView();
+    return RowView(this->l->begin(k),this->l->end(k));
+}
+
+//    Compare scanline row_number to its neighbours and add the differences to out. Each difference covers a range of
+//    scanlines in the other orientation and is added as one span. The scanlines are looked up from run cur on.
+void DrcSl::transpose_row(size_t &cur, int row_number, std::vector<int> &dif, std::vector<EdgeSpan> &out)
+{
+    RowView row_last = view(cur,row_number - 1);
+    RowView row = view(cur,row_number);
+    size_t k = cur;
+    RowView row_next = view(k,row_number + 1);
+
+    dif.clear();
+    listdif(row_last,row,dif);
+    for (size_t d = 0; d < dif.size(); d += 2)
     {
-        rit->pos++;
-        rit++;
-        rit->pos--;
+        if (dif[d] <= dif[d+1])
+            out.emplace_back(dif[d],dif[d+1]+1,edgecoord(row_number,1));
     }
-    it++;
-    int row_number = 2;
-    for (int n = 2; n < this->s(); n++)
+    dif.clear();
+    listdif(row_next,row,dif);
+    for (size_t d = 0; d < dif.size(); d += 2)
     {
-        row_next = *it;
-        for(rit = row_next.begin(); rit != row_next.end(); rit++)
+        if (dif[d] <= dif[d+1])
+            out.emplace_back(dif[d],dif[d+1]+1,edgecoord(row_number,0));
+    }
+}
+
+//    Update dst, the result of the last switch from the current orientation, for the scanlines in rows which changed
+//    since then. The edges a changed scanline and its two neighbours produced are dropped from dst and replaced by the
+//    ones they produce now. A full switch adds the edges of every scanline of the other orientation in the order of
+//    compare_edgecoord, so the new edges are merged into the remaining ones in this order. dst is rebuilt in one pass,
+//    split into runs at the start and end of every new edge.
+void DrcSl::transpose_changed(const DirtyRows &rows, SparseRows &dst)
+{
+    std::vector<int> redo;
+    for(size_t i = 0; i < rows.ranges.size(); i += 2)
+    {
+        int lo = std::max(rows.ranges[i] - 1,1);
+        int hi = std::min(rows.ranges[i+1] + 1,this->s() - 1);
+        if(lo >= hi)
+            continue;
+        if(!redo.empty() && redo.back() >= lo)
+            redo.back() = std::max(redo.back(),hi);
+        else
         {
-            rit->pos++;
-            rit++;
-            rit->pos--;
+            redo.push_back(lo);
+            redo.push_back(hi);
         }
+    }
+    if(redo.empty())
+        return;
+
+    //  The spans come in ascending scanlines, which is the order of their edges in each scanline of dst.
+    std::vector<EdgeSpan> spans;
+    size_t cur = 0;
+    std::vector<int> dif;
+    for(size_t i = 0; i < redo.size(); i += 2)
+    {
+        for(int r = redo[i]; r < redo[i+1]; r++)
+            transpose_row(cur,r,dif,spans);
+    }
 
-        dif1 = listdif(row_last,row);
-        dif2 = listdif(row_next,row);
-
-        int b;
-        int e;
-        dit = dif1.begin();
-        while(dit != dif1.end())
+    std::vector<int> bp;
+    bp.reserve(2 * (dst.size() + spans.size()));
+    for(size_t k = 0; k < dst.size(); k++)
+    {
+        bp.push_back(dst.ind[k]);
+        bp.push_back(dst.ind[k] + dst.len[k]);
+    }
+    size_t mid = bp.size();
+    for(EdgeSpan &sp : spans)
+    {
+        bp.push_back(sp.lo);
+        bp.push_back(sp.hi);
+    }
+    std::sort(bp.begin() + mid,bp.end());
+    std::inplace_merge(bp.begin(),bp.begin() + mid,bp.end());
+    bp.erase(std::unique(bp.begin(),bp.end()),bp.end());
+
+    std::vector<size_t> order(spans.size());
+    for(size_t s = 0; s < spans.size(); s++)
+        order[s] = s;
+    std::stable_sort(order.begin(),order.end(),[&spans](size_t s1, size_t s2)
+    {
+        return spans[s1].lo < spans[s2].lo;
+    });
+
+    SparseRows out;
+    out.edges.reserve(dst.edges.size() + spans.size());
+    std::vector<size_t> active;
+    size_t next = 0;
+    size_t k = 0;
+    for(size_t j = 0; j + 1 < bp.size(); j++)
+    {
+        int y = bp[j];
+        active.erase(std::remove_if(active.begin(),active.end(),[&spans,y](size_t s)
         {
-            b = *dit;
-            dit++;
-            e = *dit;
-            dit++;
-            for (; b!=e+1; b++)
+            return spans[s].hi <= y;
+        }),active.end());
+        for(; next < order.size() && spans[order[next]].lo == y; next++)
+            active.insert(std::upper_bound(active.begin(),active.end(),order[next]),order[next]);
+        while(k < dst.size() && dst.ind[k] + dst.len[k] <= y)
+            k++;
+        bool in = k < dst.size() && dst.ind[k] <= y;
+        if(!in && active.empty())
+            continue;
+
+        //  Merge the edges of the run which are not transposed again with the new ones. An edge lies in one of the
+        //  scanlines to redo if an odd number of range limits is at or below its position.
+        size_t start = out.edges.size();
+        const edgecoord *it = in ? dst.begin(k) : nullptr;
+        const edgecoord *last = in ? dst.end(k) : nullptr;
+        size_t ri = 0;
+        size_t a = 0;
+        while(it != last || a < active.size())
+        {
+            if(it != last)
             {
-                edgecoord p = edgecoord(row_number-1,1);
-                l_new[b].push_back(p);
+                if(ri < redo.size() && redo[ri] <= it->pos)
+                    ri = std::upper_bound(redo.begin() + ri,redo.end(),it->pos) - redo.begin();
+                if(ri & 1)
+                {
+                    it++;
+                    continue;
+                }
             }
+            if(a == active.size() || (it != last && !compare_edgecoord(spans[active[a]].e,*it)))
+                out.edges.push_back(*it++);
+            else
+                out.edges.push_back(spans[active[a++]].e);
         }
-        dit = dif2.begin();
-        while(dit != dif2.end())
+        if(out.edges.size() > start)
         {
-            b = *dit;
-            dit++;
-            e = *dit;
-            dit++;
-            for (; b!=e+1; b++)
-            {
-                edgecoord p = edgecoord(row_number-1,0);
-                l_new[b].push_back(p);
-            }
+            out.ind.push_back(y);
+            out.len.push_back(bp[j+1] - y);
+            out.off.push_back(out.edges.size());
         }
-        row_last = row;
-        row = row_next;
-        row_number++;
-        it++;
     }
-    this->l = l_new;
-    this-> orientation = this->orientation ? hor : ver;
+    out.coalesce();
+    std::swap(dst,out);
 }
 
 
@@ -603,19 +1392,21 @@ void DrcSl::switch_dimensions()
 //    and vice-versa, the algorithm will not fix the violation. For performance reasons
 //    it is still the user's task to perform DRC and ensure the design is clean. For standard photonic structures it is
 //    unlikely that such a case occurs.
-void DrcSl::clean(int maxtries)
+//    The sequence is shared by DrcSl and DrcSlBands, so that a layer cleaned in bands takes the same decisions.
+template<class Cleaner>
+static void clean_passes(Cleaner &c, int maxtries)
 {
     for(int i = 0; i < maxtries; i++)
     {
-        if(clean_space())
+        if(c.clean_space())
         {
-            switch_dimensions();
+            c.switch_dimensions();
         }
         else
         {
-            if(clean_space())
+            if(c.clean_space())
             {
-                switch_dimensions();
+                c.switch_dimensions();
                 continue;
             }
             else
@@ -628,17 +1419,17 @@ void DrcSl::clean(int maxtries)
     }
     for(int i = 0; i < maxtries; i++)
     {
-        if(clean_width())
+        if(c.clean_width())
         {
 //                If progress output is desired uncomment the following lines
 //                std::cout<< "Try: " << i << "/" << maxtries << std::endl;
-            switch_dimensions();
+            c.switch_dimensions();
         }
         else
         {
-            if(clean_width())
+            if(c.clean_width())
             {
-                switch_dimensions();
+                c.switch_dimensions();
                 continue;
             }
             else
@@ -651,25 +1442,25 @@ void DrcSl::clean(int maxtries)
     }
     for(int i = 0; i < maxtries; i++)
     {
-        if(clean_space())
+        if(c.clean_space())
         {
 //                If progress output is desired uncomment the following lines
 //                std::cout<< "Try: " << i << "/" << maxtries << std::endl;
-            switch_dimensions();
+            c.switch_dimensions();
         }
         else
         {
-            if(clean_space())
+            if(c.clean_space())
             {
-                switch_dimensions();
+                c.switch_dimensions();
             }
             else
             {
-                if (this->orientation)
+                if (c.get_orientation())
                 {
 //                        If progress output is desired uncomment the following lines
 //                        std::cout<< "Finished after " << i+1 << " tries" << std::endl;
-                    switch_dimensions();
+                    c.switch_dimensions();
                     break;
                 }
             }
@@ -679,84 +1470,413 @@ void DrcSl::clean(int maxtries)
 //        std::cout<< "Done cleaning" << std::endl;
 }
 
+void DrcSl::clean(int maxtries)
+{
+    clean_passes(*this,maxtries);
+}
+
+//    Current orientation of the scanlines. 0: row-oriented, 1: column-oriented.
+int DrcSl::get_orientation()
+{
+    return this->orientation;
+}
+
+//    Number of scanlines a band overlaps its neighbours when the layer is cleaned in horizontal bands.
+//    A cleaning pass in column orientation can only change a band within one rule distance of its cut border. Until the
+//    bands return to row orientation and their halos are refreshed, at most a space, a width and another space pass run
+//    in column orientation, so the halo covers these three distances plus the padding of the scanlines.
+int DrcSl::halo()
+{
+    return halo(this->violation_space,this->violation_width);
+}
+
+//    Halo of a layer with the rules violation_space and violation_width, for the code which has no cleaner of it.
+int DrcSl::halo(int violation_space, int violation_width)
+{
+    return 2 * violation_space + violation_width + 3;
+}
+
+//    Horizontal bands of one layer which are cleaned in lockstep. Every pass runs on all bands through pfor and the
+//    decision whether to continue is taken on the violations of all bands together. Each band only counts the violations
+//    in its own rows. Whenever the bands return to row orientation, their halo rows are refreshed from the bands that own
+//    those rows, so errors introduced at the cut borders of the bands never reach the rows they own.
+class DrcSlBands
+{
+public:
+    DrcSlBands(DrcSl &sl, int nbands, const ParallelFor &pfor);
+    int clean_space();
+    int clean_width();
+    void switch_dimensions();
+    int get_orientation();
+    void stitch();
+
+private:
+    DrcSl &sl;
+    const ParallelFor &pfor;
+    std::vector<DrcSl> bands;
+    std::vector<int> limits;
+    int h;
+
+    void copy_rows(DrcSl &src, int y1, int y2, SparseRows &dst, int dst_ver1);
+    void refresh();
+};
+
+//    Split the rows of sl into nbands bands of equal height and copy each band with its halo. Like any cleaner, a band
+//    keeps two empty scanlines of padding around its rows, which is where the band is cut from the layer.
+DrcSlBands::DrcSlBands(DrcSl &sl, int nbands, const ParallelFor &pfor): sl(sl), pfor(pfor), bands(nbands)
+{
+    sl.l->commit();
+    this->h = sl.halo();
+    int rows = sl.ver2 - sl.ver1 + 1;
+    for(int i = 0; i <= nbands; i++)
+    {
+        this->limits.push_back(sl.ver1 + (int)((long long)rows * i / nbands));
+    }
+    this->pfor(nbands,[this](int i)
+    {
+        DrcSl &band = this->bands[i];
+        band.initialize_list(this->sl.hor1+2,this->sl.hor2-2,this->limits[i]-this->h,this->limits[i+1]+this->h,
+                             this->sl.violation_space,this->sl.violation_width);
+        band.count_lo = this->limits[i];
+        band.count_hi = this->limits[i+1];
+        copy_rows(this->sl,band.ver1+2,band.ver2-2,band.lhor,band.ver1);
+        band.lhor.coalesce();
+    });
+}
+
+//    Append the rows y1 to y2-1 of src (which has to be row-oriented) to dst, whose row 0 is at dst_ver1.
+void DrcSlBands::copy_rows(DrcSl &src, int y1, int y2, SparseRows &dst, int dst_ver1)
+{
+    int lo = y1 - src.ver1;
+    int hi = y2 - src.ver1;
+    int shift = dst_ver1 - src.ver1;
+    for(size_t k = 0; k < src.l->size(); k++)
+    {
+        int b = std::max(src.l->ind[k],lo);
+        int e = std::min(src.l->ind[k] + src.l->len[k],hi);
+        if(b < e)
+            dst.append(b - shift,e - b,src.l->begin(k),src.l->end(k));
+    }
+}
+
+//    Replace all rows of each band by the rows of the bands that own them. The rows that differ are revisited by the
+//    following passes of the band.
+void DrcSlBands::refresh()
+{
+    std::vector<SparseRows> fresh(this->bands.size());
+    std::vector<std::vector<int>> rows(this->bands.size());
+    this->pfor(this->bands.size(),[this,&fresh,&rows](int i)
+    {
+        DrcSl &band = this->bands[i];
+        for(size_t j = 0; j < this->bands.size(); j++)
+        {
+            int b = std::max(this->limits[j],band.ver1+2);
+            int e = std::min(this->limits[j+1],band.ver2-2);
+            if(b < e)
+                copy_rows(this->bands[j],b,e,fresh[i],band.ver1);
+        }
+        fresh[i].coalesce();
+        fresh[i].diff(band.lhor,rows[i]);
+    });
+    for(size_t i = 0; i < this->bands.size(); i++)
+    {
+        std::swap(this->bands[i].lhor,fresh[i]);
+        this->bands[i].changed(hor,rows[i]);
+    }
+}
+
+int DrcSlBands::clean_space()
+{
+    std::vector<int> vios(this->bands.size());
+    this->pfor(this->bands.size(),[this,&vios](int i)
+    {
+        vios[i] = this->bands[i].clean_space();
+    });
+    int sum = 0;
+    for(int v : vios)
+        sum += v;
+    return sum;
+}
+
+int DrcSlBands::clean_width()
+{
+    std::vector<int> vios(this->bands.size());
+    this->pfor(this->bands.size(),[this,&vios](int i)
+    {
+        vios[i] = this->bands[i].clean_width();
+    });
+    int sum = 0;
+    for(int v : vios)
+        sum += v;
+    return sum;
+}
+
+void DrcSlBands::switch_dimensions()
+{
+    this->pfor(this->bands.size(),[this](int i)
+    {
+        this->bands[i].switch_dimensions();
+    });
+    if(!get_orientation())
+        refresh();
+}
+
+int DrcSlBands::get_orientation()
+{
+    return this->bands.front().get_orientation();
+}
+
+//    Replace the rows of the layer by the rows each band owns.
+void DrcSlBands::stitch()
+{
+    if(get_orientation())
+        switch_dimensions();
+
+    sl.lhor.clear();
+    sl.lver.clear();
+    sl.l = &sl.lhor;
+    sl.orientation = hor;
+    for(size_t i = 0; i < this->bands.size(); i++)
+    {
+        copy_rows(this->bands[i],this->limits[i],this->limits[i+1],sl.lhor,sl.ver1);
+    }
+    sl.lhor.coalesce();
+    sl.invalidate();
+}
+
+//    Clean the layer in nbands horizontal bands that are processed through pfor. The result is the same as the one of clean().
+//    Has to be called after sortlist() in row orientation.
+void DrcSl::clean_tiled(int nbands, const ParallelFor &pfor, int maxtries)
+{
+    if(nbands < 2)
+    {
+        clean(maxtries);
+        return;
+    }
+    DrcSlBands bands(*this,nbands,pfor);
+    clean_passes(bands,maxtries);
+    bands.stitch();
+}
+
 std::vector<std::vector<int>> DrcSl::get_lines()
 {
     std::vector<std::vector<int>>lines (this->s());
 
     int offset_d2 = this->orientation ? -this->ver1 : -this-> hor1;
 
-    for(int i = 0; i< this->s(); i++)
+    this->l->commit();
+    for(size_t k = 0; k < this->l->size(); k++)
     {
-        for(auto iter: this->l[i])
+        for(edgecoord *iter = this->l->begin(k); iter != this->l->end(k); iter++)
         {
-            lines[i].push_back(iter.type ? iter.pos-1-offset_d2 : iter.pos+1-offset_d2);
+            lines[this->l->ind[k]].push_back(iter->type ? iter->pos-1-offset_d2 : iter->pos+1-offset_d2);
+        }
+        for(int i = 1; i < this->l->len[k]; i++)
+        {
+            lines[this->l->ind[k]+i] = lines[this->l->ind[k]];
         }
     }
     return lines;
 }
 
-std::vector<std::vector<pi>> DrcSl::get_polygons()
+//    Export all scanlines at once. Run k covers the scanlines y[k] to y[k]+h[k]-1, which all have the coordinates
+//    x[off[k]] to x[off[k+1]-1]. Like in get_vect(), these are the begin and end of each interval one after another.
+void DrcSl::get_runs(std::vector<int> &y, std::vector<int> &h, std::vector<int> &off, std::vector<int> &x)
+{
+    int offset = this->orientation ? -this->hor1 : -this-> ver1;
+    int offset_d2 = this->orientation ? -this->ver1 : -this-> hor1;
+
+    this->l->commit();
+    y.resize(this->l->size());
+    h.resize(this->l->size());
+    off.resize(this->l->size() + 1);
+    x.resize(this->l->edges.size());
+    off[0] = 0;
+    for(size_t k = 0; k < this->l->size(); k++)
+    {
+        y[k] = this->l->ind[k] - offset;
+        h[k] = this->l->len[k];
+        off[k+1] = this->l->off[k+1];
+        for(size_t n = this->l->off[k]; n < this->l->off[k+1]; n++)
+        {
+            edgecoord &e = this->l->edges[n];
+            x[n] = e.type ? e.pos-1-offset_d2 : e.pos+1-offset_d2;
+        }
+    }
+}
+
+//    Cover the scanlines with rectangles which do not overlap. Every interval is extended upwards as long as the next
+//    scanline has exactly the same interval, so the rectangles are as high as possible and can be used without merging
+//    them. The rectangles are stored as x1,y1,x2,y2 in rects, ordered by their bottom.
+void DrcSl::get_rectangles(std::vector<int> &rects)
+{
+    int offset = this->orientation ? -this->hor1 : -this-> ver1;
+    int offset_d2 = this->orientation ? -this->ver1 : -this-> hor1;
+
+    //  Rectangles which reach up to open_end, in the order of their intervals.
+    std::vector<size_t> open;
+    std::vector<size_t> next;
+    int open_end = 0;
+
+    this->l->commit();
+    rects.clear();
+    for(size_t k = 0; k < this->l->size(); k++)
+    {
+        int y = this->l->ind[k] - offset;
+        int h = this->l->len[k];
+        if(open_end != y)
+            open.clear();
+        next.clear();
+        size_t a = 0;
+        for(edgecoord *ei = this->l->begin(k); ei != this->l->end(k); ei+=2)
+        {
+            int x1 = ei->pos+1-offset_d2;
+            int x2 = (ei+1)->pos-1-offset_d2;
+            while(a < open.size() && rects[4*open[a]] < x1)
+                a++;
+            if(a < open.size() && rects[4*open[a]] == x1 && rects[4*open[a]+2] == x2)
+            {
+                rects[4*open[a]+3] += h;
+                next.push_back(open[a]);
+                a++;
+            }
+            else
+            {
+                next.push_back(rects.size() / 4);
+                rects.push_back(x1);
+                rects.push_back(y);
+                rects.push_back(x2);
+                rects.push_back(y+h);
+            }
+        }
+        open.swap(next);
+        open_end = y + h;
+    }
+}
+
+//    Assemble the scanlines to polygons. Polygon j consists of the points off[j] to off[j+1]-1, which are stored as x,y in
+//    points.
+//
+//    The runs are swept upwards. The fragments that are open at the bottom of a run are the ones the run below extended,
+//    in the order of their intervals. They are matched to the intervals of the run with one pointer moving to the right,
+//    so only open fragments that can overlap an interval are looked at. Intervals which overlap the same fragment are
+//    a group: a single interval extends the fragment, several ones become its children. If an interval overlaps several
+//    fragments, it extends the one created first and the others are closed.
+void DrcSl::get_polygons_flat(std::vector<int> &off, std::vector<int> &points)
+{
+    get_polygons_flat(off,points,INT_MIN,INT_MAX);
+}
+
+//    Like above, but only the scanlines from y1 to y2-1 are assembled. Polygons which cross y1 or y2 are cut there, so
+//    the polygons of adjacent ranges do not overlap and together cover the layer.
+void DrcSl::get_polygons_flat(std::vector<int> &off, std::vector<int> &points, int y1, int y2)
 {
     splits.clear();
-    polygons.clear();
+    sides.clear();
     int offset = this->orientation ? -this-> hor1 : -this-> ver1;
     int offset_d1 = (this->orientation ? -this->ver1 : -this-> hor1) - 1;
     int offset_d2 = (this->orientation ? -this->ver1 : -this-> hor1) + 1;
 
-    for(int i = 1; i< this->s(); i++)
+    std::vector<int> active;
+    std::vector<int> next;
+    int active_end = 0;
+
+    this->l->commit();
+    for(size_t k = 0; k < this->l->size(); k++)
     {
+        int i = this->l->ind[k];
+        int h = this->l->len[k];
+        if(i < 1)
+            continue;
         int y = i - offset;
+        //  The runs are ordered by their scanlines.
+        if(y >= y2)
+            break;
+        if(y + h <= y1)
+            continue;
+        if(y < y1)
+        {
+            h -= y1 - y;
+            y = y1;
+        }
+        if(y + h > y2)
+            h = y2 - y;
+        if(active_end != y)
+            active.clear();
+        size_t ap = 0;
+
+        //  First created open fragment which overlaps x1 to x2, or -1.
+        auto lookup = [&](int x1, int x2)
+        {
+            while(ap < active.size() && splits[active[ap]].erx < x1)
+                ap++;
+            int found = -1;
+            for(size_t a = ap; a < active.size() && splits[active[a]].elx <= x2; a++)
+            {
+                if(splits[active[a]].end == y && (found < 0 || active[a] < found))
+                    found = active[a];
+            }
+            return found;
+        };
+        auto create = [&](int x1, int x2, int merge_ind)
+        {
+            SplitPolygon sp;
+            sp.init(sides,x1,x2,y,h);
+            sp.merge_ind = merge_ind;
+            splits.push_back(sp);
+            int n = splits.size() - 1;
+            if(merge_ind >= 0)
+            {
+                SplitPolygon &parent = splits[merge_ind];
+                if(parent.last_child >= 0)
+                    splits[parent.last_child].next_sibling = n;
+                else
+                    parent.first_child = n;
+                parent.last_child = n;
+            }
+            next.push_back(n);
+        };
+        //  Attach the intervals from first to last (exclusive) to the fragment spit.
+        auto flush = [&](int spit, edgecoord *first, edgecoord *last)
+        {
+            if(last - first == 2)
+            {
+                splits[spit].append(sides,first->pos - offset_d1,(first+1)->pos - offset_d2,y,h);
+                next.push_back(spit);
+            }
+            else if(last - first > 2)
+            {
+                for(edgecoord *eit = first; eit != last; eit += 2)
+                    create(eit->pos - offset_d1,(eit+1)->pos - offset_d2,spit);
+            }
+        };
+
+        next.clear();
         bool advance = true;
-        spv::iterator spit = splits.begin();
-        ev::iterator append_first = this->l[i].begin();
-        ev::iterator append_last = this->l[i].begin();
+        int spit = -1;
+        edgecoord *append_first = this->l->begin(k);
+        edgecoord *append_last = this->l->begin(k);
 
-        for(ev::iterator ei = this->l[i].begin(); ei != this->l[i].end(); ei+=2)
+        for(edgecoord *ei = this->l->begin(k); ei != this->l->end(k); ei+=2)
         {
             int x1 = ei->pos - offset_d1;
             int x2 = (ei+1)->pos - offset_d2;
 
             if(advance)
             {
-                spit = std::find_if(splits.begin(),splits.end(), [x1,x2,y,offset_d2,offset_d1] (SplitPolygon & sp)
-                {
-                    return ((sp.end ==y) && !((sp.erx < x1) || (sp.elx > x2)));
-                });
+                spit = lookup(x1,x2);
                 advance = false;
             }
 
-            if(spit != splits.end())
+            if(spit >= 0)
             {
-                int ex1 = spit->elx;
-                int ex2 = spit->erx;
-
-                if(((x1 > ex2) || (x2 < ex1)) && spit->end == y)
+                if((x1 > splits[spit].erx) || (x2 < splits[spit].elx))
                 {
-                    int l = append_last - append_first;
-                    if(l == 2)
-                    {
-                        spit->append(append_first->pos - offset_d1, (append_first+1)->pos -offset_d2, y);
-                    }
-                    if(l > 2)
+                    flush(spit,append_first,append_last);
+                    spit = lookup(x1,x2);
+                    if(spit < 0)
                     {
-                        int merge_ind = spit - splits.begin();
-                        for(ev::iterator eit = append_first; eit != append_last; eit +=2)
-                        {
-                            SplitPolygon sp = SplitPolygon();
-                            sp.init(eit->pos - offset_d1,(eit+1)->pos - offset_d2,y);
-                            sp.merge_ind = merge_ind;
-                            splits.push_back(sp);
-                        }
-                    }
-                    spit = std::find_if(splits.begin(),splits.end(), [x1,x2,y,offset_d2,offset_d1] (SplitPolygon & sp)
-                    {
-                        return ((sp.end ==y) && !((sp.erx < x1) || (sp.elx > x2)));
-                    });
-                    if(spit == splits.end())
-                    {
-                        SplitPolygon sp = SplitPolygon();
-                        sp.init(x1,x2,y);
-                        splits.push_back(sp);
+                        create(x1,x2,-1);
                         append_first = ei + 2;
                         append_last = ei + 2;
                         advance = true;
@@ -774,44 +1894,69 @@ std::vector<std::vector<pi>> DrcSl::get_polygons()
             }
             else
             {
-                SplitPolygon sp = SplitPolygon();
-                sp.init(x1,x2,y);
-                splits.push_back(sp);
+                create(x1,x2,-1);
                 append_first = ei + 2;
                 append_last = ei + 2;
                 advance = true;
             }
         }
+        if(spit >= 0)
+            flush(spit,append_first,append_last);
 
-        int l = append_last - append_first;
-        if(l == 2)
-        {
-            spit->append(append_first->pos - offset_d1, (append_first+1)->pos -offset_d2, y);
-        }
-        else if(l > 2)
+        active.swap(next);
+        active_end = y + h;
+    }
+
+    //  Output the fragments without parent, last created first. A polygon runs up its right side, through its children
+    //  from the last to the first one and down its left side.
+    off.assign(1,0);
+    points.clear();
+    std::vector<int> stack;
+    for(int r = (int)splits.size() - 1; r >= 0; r--)
+    {
+        if(splits[r].merge_ind >= 0)
+            continue;
+        stack.push_back(r);
+        while(!stack.empty())
         {
-            int merge_ind = spit - splits.begin();
-            for(ev::iterator eit = append_first; eit != append_last; eit +=2)
+            int f = stack.back();
+            stack.pop_back();
+            if(f >= 0)
+            {
+                for(int n = splits[f].right_first; n >= 0; n = sides[n].next)
+                {
+                    points.push_back(sides[n].x);
+                    points.push_back(sides[n].y);
+                }
+                stack.push_back(~f);
+                for(int c = splits[f].first_child; c >= 0; c = splits[c].next_sibling)
+                    stack.push_back(c);
+            }
+            else
             {
-                SplitPolygon sp = SplitPolygon();
-                sp.init(eit->pos - offset_d1,(eit+1)->pos - offset_d2,y);
-                sp.merge_ind = merge_ind;
-                splits.push_back(sp);
+                for(int n = splits[~f].left_first; n >= 0; n = sides[n].next)
+                {
+                    points.push_back(sides[n].x);
+                    points.push_back(sides[n].y);
+                }
             }
         }
+        off.push_back(points.size() / 2);
     }
-    for(auto sp = splits.rbegin(); sp!=splits.rend(); sp++)
+}
+
+std::vector<std::vector<pi>> DrcSl::get_polygons()
+{
+    std::vector<int> off;
+    std::vector<int> points;
+    get_polygons_flat(off,points);
+
+    std::vector<std::vector<pi>> polygons(off.size() - 1);
+    for(size_t j = 0; j + 1 < off.size(); j++)
     {
-        sp->right_merge();
-        if(sp->merge_ind >= 0)
-        {
-            splits[sp->merge_ind].right_insert(sp->right);
-        }
-        else
-        {
-            polygons.push_back(*(sp->right));
-        }
-        sp->destroy();
+        polygons[j].reserve(off[j+1] - off[j]);
+        for(int n = off[j]; n < off[j+1]; n++)
+            polygons[j].push_back(std::make_pair(points[2*n],points[2*n+1]));
     }
     return polygons;
 }
@@ -20,6 +20,9 @@
 #include <vector>
 #include <algorithm>
 #include <iostream>
+#include <cstdint>
+#include <climits>
+#include <functional>
 
 typedef std::pair<int,int> pi;
 
@@ -29,12 +32,27 @@ namespace drclean
 {
 
 
-struct SplitPolygon
+//  Point on one side of a polygon fragment. The points of all fragments are kept in one pool and linked through next.
+struct SidePoint
 {
+    int x;
+    int y;
+    int next;
+};
 
-public:
-    std::vector<pi>* left;
-    std::vector<pi>* right;
+//  Polygon fragment which is assembled while sweeping upwards over the scanlines. Every scanline adds one interval.
+//  The right side is linked from bottom to top and the left side from top to bottom, so that both only grow at the end
+//  that is linked last. A fragment whose interval splits into several ones on the next scanline is closed and gets a
+//  child fragment (with merge_ind set to it) for each of them. Children are inserted between the right and the left
+//  side of their parent when the polygon is output.
+struct SplitPolygon
+{
+    int right_first;
+    int right_last;
+    int left_first;
+    int first_child;
+    int last_child;
+    int next_sibling;
 
     int begin;
     int end;
@@ -42,74 +60,55 @@ public:
     int elx,erx;
     int merge_ind;
 
-    SplitPolygon():merge_ind(-1)
-    {
-        right = new std::vector<pi>();
-        left = new std::vector<pi>();
-    };
-    int can_append(int x1, int x2, int l)
-    {
-        if (l != end +1 )
-            return 0;
-        if(x2 < left->back().first)
-            return 1;
-        if(x1 > right->back().second)
-            return -1;
-        return 2;
-    }
-    void destroy()
+    //  h is the number of identical scanlines starting at l that are added at once.
+    void init(std::vector<SidePoint> &pool, int x1, int x2, int l, int h = 1)
     {
-        delete right;
-        delete left;
-    }
-    void init(int x1, int x2, int l)
-    {
-        left->push_back(std::make_pair(x1,l));
-        left->push_back(std::make_pair(x1,l+1));
-        right->push_back(std::make_pair(x2,l));
-        right->push_back(std::make_pair(x2,l+1));
+        right_first = pool.size();
+        pool.push_back({x2,l,(int)pool.size() + 1});
+        pool.push_back({x2,l+h,-1});
+        right_last = pool.size() - 1;
+        pool.push_back({x1,l+h,(int)pool.size() + 1});
+        pool.push_back({x1,l,-1});
+        left_first = pool.size() - 2;
+        first_child = -1;
+        last_child = -1;
+        next_sibling = -1;
+        merge_ind = -1;
         begin = l;
-        end = l+1;
+        end = l+h;
         blx = x1;
         brx = x2;
         elx = x1;
         erx = x2;
     }
 
-    int append(int x1, int x2, int l)
+    void append(std::vector<SidePoint> &pool, int x1, int x2, int l, int h = 1)
     {
-        if(x1 == left->back().first)
+        if(x1 == pool[left_first].x)
         {
-            left->back().second++;
+            pool[left_first].y += h;
         }
         else
         {
-            left->push_back(std::make_pair(x1,l));
-            left->push_back(std::make_pair(x1,l+1));
+            pool.push_back({x1,l,left_first});
+            pool.push_back({x1,l+h,(int)pool.size() - 1});
+            left_first = pool.size() - 1;
         }
 
-        if(x2 == right->back().first)
+        if(x2 == pool[right_last].x)
         {
-            right->back().second++;
+            pool[right_last].y += h;
         }
         else
         {
-            right->push_back(std::make_pair(x2,l));
-            right->push_back(std::make_pair(x2,l+1));
+            pool[right_last].next = pool.size();
+            pool.push_back({x2,l,(int)pool.size() + 1});
+            pool.push_back({x2,l+h,-1});
+            right_last = pool.size() - 1;
         }
-        end = l+1;
+        end = l+h;
         elx = x1;
         erx = x2;
-        return true;
-    }
-    void right_insert(std::vector<pi>* polygon)
-    {
-        right->insert(right->end(),polygon->begin(),polygon->end());
-    }
-    void right_merge()
-    {
-        right->insert(right->end(),left->rbegin(),left->rend());
-        left->clear();
     }
 };
 
@@ -128,29 +127,196 @@ struct edgecoord
     **  @pos: The coordinate of an edge.
     **  @type:The type of an edge.  0: Polygon is in the positive coordinate direction from the edge.
     **                              1: Polygon is in the negative coordinate direction from the edge.
+    **  Edges that are marked for removal are tracked in the bitmask of the scanline storage.
     */
 
     int pos;
     int type;
-    bool rem = false;
-    edgecoord(int p, int t, bool r = false): pos(p), type(t), rem(r) {};
-    virtual ~edgecoord() {};
+    edgecoord(int p, int t): pos(p), type(t) {};
 };
 
+static_assert(sizeof(edgecoord) == 8, "edgecoord is expected to be packed into 8 bytes");
 
 typedef std::vector<edgecoord> ev;
 
+//  An edge which is present on all scanlines from lo to hi-1.
+struct EdgeSpan
+{
+    int lo;
+    int hi;
+    edgecoord e;
+    EdgeSpan(int l, int h, const edgecoord &ec): lo(l), hi(h), e(ec) {};
+};
+
+//  Read-only view of the edges of one scanline. listdif() compares the intervals with both ends moved inwards by one,
+//  inner() does this while reading, so no copy of the scanline is needed.
+struct RowView
+{
+    const edgecoord *b;
+    const edgecoord *e;
+    RowView(): b(nullptr), e(nullptr) {};
+    RowView(const edgecoord *first, const edgecoord *last): b(first), e(last) {};
+    size_t size() const
+    {
+        return e - b;
+    }
+    int inner(size_t n) const
+    {
+        return (n & 1) ? b[n].pos - 1 : b[n].pos + 1;
+    }
+};
+
+//  Runs fn(0) to fn(n-1), possibly concurrently, and returns once all of them have finished.
+typedef std::function<void(int n, const std::function<void(int)> &fn)> ParallelFor;
+
+//  Scanlines which changed since a pass last visited them, as sorted ranges ranges[2i] to ranges[2i+1]-1 which neither
+//  overlap nor touch. While all is set, every scanline counts as changed.
+struct DirtyRows
+{
+    bool all = true;
+    std::vector<int> ranges;
+
+    void reset()
+    {
+        all = false;
+        ranges.clear();
+    }
+    void add(const std::vector<int> &rows);
+    //  Whether scanline i lies in one of the ranges.
+    bool contains(int i) const
+    {
+        return all || ((std::upper_bound(ranges.begin(),ranges.end(),i) - ranges.begin()) & 1);
+    }
+    size_t count() const;
+};
+
+//  Sparse storage of the scanlines of one orientation in compressed row format. Only scanlines which carry edges are stored,
+//  and consecutive identical scanlines are stored once as a run. Run k covers the scanlines ind[k] to ind[k]+len[k]-1,
+//  its edges are edges[off[k]] to edges[off[k+1]-1]. Edges are marked for removal in the bitmask rem and removed by compact().
+//  New edges are collected in pending and sorted into the runs by commit(), which splits runs only where the pending edges
+//  start or end.
+struct SparseRows
+{
+    std::vector<int> ind;
+    std::vector<int> len;
+    std::vector<size_t> off = std::vector<size_t>(1,0);
+    std::vector<edgecoord> edges;
+    std::vector<uint64_t> rem;
+    std::vector<EdgeSpan> pending;
+
+    void clear()
+    {
+        ind.clear();
+        len.clear();
+        off.assign(1,0);
+        edges.clear();
+        rem.clear();
+        pending.clear();
+    }
+    void push(int lo, int hi, const edgecoord &e)
+    {
+        pending.emplace_back(lo,hi,e);
+    }
+    void push(std::vector<std::vector<EdgeSpan>> &buckets);
+    size_t size() const
+    {
+        return ind.size();
+    }
+    edgecoord* begin(size_t k)
+    {
+        return edges.data() + off[k];
+    }
+    edgecoord* end(size_t k)
+    {
+        return edges.data() + off[k+1];
+    }
+    bool marked(size_t n) const
+    {
+        return (rem[n >> 6] >> (n & 63)) & 1;
+    }
+    void mark(size_t n)
+    {
+        rem[n >> 6] |= uint64_t(1) << (n & 63);
+    }
+    //  Append a run behind all existing runs. Used to assemble a store from sorted pieces, finish with coalesce().
+    void append(int lo, int n, const edgecoord *first, const edgecoord *last)
+    {
+        ind.push_back(lo);
+        len.push_back(n);
+        edges.insert(edges.end(),first,last);
+        off.push_back(edges.size());
+    }
+    void commit();
+    void commit(const ParallelFor &pfor, int nchunks);
+    void compact();
+    void compact(const ParallelFor &pfor, int nchunks);
+    void coalesce();
+    size_t find(int i) const;
+    std::vector<size_t> split(int n) const;
+    void diff(const SparseRows &other, std::vector<int> &out) const;
+
+    //  Marks edges of the runs first_run to last_run-1 for removal. The bitmask words this chunk of runs may share with
+    //  the neighbouring chunks are collected separately and merged by flush() once all chunks are done, so that chunks
+    //  can be marked concurrently. The runs in which edges were marked are collected in runs.
+    struct Marker
+    {
+        SparseRows &rows;
+        size_t first;
+        size_t last;
+        uint64_t head = 0;
+        uint64_t tail = 0;
+        bool any = false;
+        std::vector<size_t> runs;
+
+        Marker(SparseRows &r, size_t first_run, size_t last_run): rows(r)
+        {
+            first = r.off[first_run] >> 6;
+            last = r.off[last_run] > 0 ? (r.off[last_run] - 1) >> 6 : 0;
+        }
+        //  Mark edge e of run k.
+        void mark(size_t k, edgecoord *e)
+        {
+            size_t n = e - rows.edges.data();
+            size_t w = n >> 6;
+            uint64_t bit = uint64_t(1) << (n & 63);
+            any = true;
+            if(runs.empty() || runs.back() != k)
+                runs.push_back(k);
+            if(w == first)
+                head |= bit;
+            else if(w == last)
+                tail |= bit;
+            else
+                rows.rem[w] |= bit;
+        }
+        void flush()
+        {
+            if(head)
+                rows.rem[first] |= head;
+            if(tail)
+                rows.rem[last] |= tail;
+        }
+    };
+};
+
 
 class DrcSl
 {
+    friend class DrcSlBands;
+
 public:
     DrcSl();
+    DrcSl(const DrcSl &other);
+    DrcSl& operator=(const DrcSl &other);
     ~DrcSl();
 
-    int set_data(std::vector<edgecoord> *horlist);
     void initialize_list(int hor1,int hor2, int ver1, int ver2, int violation_space, int violation_width);
     void sortlist();
     void add_data(int hor1,int hor2, int ver1, int ver2);
+    void add_edges(const int *edges, size_t n);
+    void add_polygon(const int *points, size_t n);
+    void set_threads(int nthreads);
+    void set_threads(int nthreads, const ParallelFor &pfor);
     bool list_cleaning();
     int clean_space();
     int clean_width();
@@ -158,6 +324,8 @@ public:
     std::vector<int> get_vect(int ind);
     std::vector<int> get_types(int ind);
     void clean(int max_tries = 10);
+    void clean_tiled(int nbands, const ParallelFor &pfor, int max_tries = 10);
+    int get_orientation();
     int violation_width;
     int violation_space;
     void printvector(int beg = -1, int ende = -1);
@@ -166,22 +334,54 @@ public:
     int ver1;
     int ver2;
     int s();
-    std::vector<edgecoord> *l;
     std::vector<std::vector<int>> get_lines();
     std::vector<std::vector<pi>> get_polygons();
+    void get_runs(std::vector<int> &y, std::vector<int> &h, std::vector<int> &off, std::vector<int> &x);
+    void get_polygons_flat(std::vector<int> &off, std::vector<int> &points);
+    void get_polygons_flat(std::vector<int> &off, std::vector<int> &points, int y1, int y2);
+    void get_rectangles(std::vector<int> &rects);
+    int halo();
+    static int halo(int violation_space, int violation_width);
 
 protected:
-    std::vector<int> listdif(std::vector<edgecoord> &l1,std::vector<edgecoord> &l2);
+    void listdif(const RowView &l1, const RowView &l2, std::vector<int> &out);
+    int weight(size_t k, int pos);
+    void rasterise(int px1, int px2, int py1, int py2, std::vector<EdgeSpan> &bucket);
+    void scan_edge(int px1, int px2, int py1, int py2, std::vector<EdgeSpan> &bucket);
+    int chunks(size_t nedges);
+    void commit(SparseRows *rows);
+    void run(int n, const std::function<void(int)> &fn);
+    template<class Kernel> int for_runs(Kernel kernel, DirtyRows *dirty = nullptr);
+    RowView view(size_t &k, int r);
+    void transpose_row(size_t &cur, int r, std::vector<int> &dif, std::vector<EdgeSpan> &out);
+    void transpose_changed(const DirtyRows &rows, SparseRows &dst);
+    void changed(int o, const std::vector<int> &rows);
+    void invalidate();
+    void sync();
+
+    //  Below this number of edges the row-local kernels run on one thread even if more are set.
+    static const int parallel_min_edges = 1 << 14;
 
 private:
     int i;
     bool orientation = hor; //0 -> row representation , 1 -> column representation
-    std::vector<edgecoord> *lhor;
-    std::vector<edgecoord> *lver;
+    SparseRows *l;
+    SparseRows lhor;
+    SparseRows lver;
     int shor;
     int sver;
-    std::vector<std::vector<pi>> polygons;
+    int count_lo;
+    int count_hi;
+    int nthreads = 1;
+    ParallelFor pfor;
+    //  Scanlines of each orientation which changed since its last space pass, width pass and switch to the other
+    //  orientation, and the scanlines of the other orientation that switch produced. Passes only revisit changed scanlines.
+    DirtyRows dirty_space[2];
+    DirtyRows dirty_width[2];
+    DirtyRows dirty_switch[2];
+    SparseRows transposed[2];
     std::vector<SplitPolygon> splits;
+    std::vector<SidePoint> sides;
 
 };
 
@@ -16,6 +16,7 @@
 
 # distutils: language=c++
 from libcpp.vector cimport vector
+from libcpp.pair cimport pair
 from libcpp cimport bool
 
 
@@ -28,7 +29,10 @@ cdef extern from "DrcSl.h" namespace "drclean":
 
         void initialize_list(int, int, int, int, int, int)
         void add_data(int x1, int x2, int y1, int y2)
+        void add_polygon(const int *points, size_t n) except + nogil
+        void add_edges(const int *edges, size_t n) except + nogil
         void sortlist()
+        void set_threads(int nthreads)
         void clean(int max_tries)
 
         bool list_cleaning()
@@ -40,6 +44,10 @@ cdef extern from "DrcSl.h" namespace "drclean":
         vector[int] get_vect(int ind)
         vector[int] get_types(int ind)
         vector[vector[int]] get_lines()
+        vector[vector[pair[int,int]]] get_polygons()
+        void get_runs(vector[int] &y, vector[int] &h, vector[int] &off, vector[int] &x)
+        void get_polygons_flat(vector[int] &off, vector[int] &points)
+        void get_rectangles(vector[int] &rects)
         int violation_width
         int violation_space
         int hor1
@@ -0,0 +1,219 @@
+//  This file is part of KLayoutPhotonicPCells, an extension for Photonic Layouts in KLayout.
+//  Copyright (c) 2018, Sebastian Goeldi
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef JOBQUEUE_H
+#define JOBQUEUE_H
+
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <boost/interprocess/containers/vector.hpp>
+#include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <string>
+#include <chrono>
+
+namespace bi = boost::interprocess;
+
+typedef bi::allocator<int, bi::managed_shared_memory::segment_manager>  ShmemAllocatorInt;
+typedef bi::vector<int, ShmemAllocatorInt> ShIVector;
+
+namespace drclean
+{
+
+//  Absolute time timeout_ms from now for the timed waits on the named conditions, which expect UTC.
+inline boost::posix_time::ptime deadline(int timeout_ms)
+{
+    return boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(timeout_ms);
+}
+
+//  Slot of a layer job in the queue. The data of the job, which is layer, datatype, size (x1,x2,y1,y2), the space and
+//  width rules and the edges, is stored in its own segment named by job_name(), the parts of the cleaned layer in ones
+//  named by result_name(). All segments are sized to their data and removed once they are read, so the memory in use
+//  follows the layers which are currently queued or waiting to be read.
+struct JobSlot
+{
+    enum State
+    {
+        free_slot = 0,
+        writing = 1,
+        ready = 2,
+        reading = 3,
+    };
+
+    int state;
+    unsigned ticket;
+
+    JobSlot(): state(free_slot), ticket(0) {};
+};
+
+typedef bi::allocator<JobSlot, bi::managed_shared_memory::segment_manager> ShmemAllocatorSlot;
+typedef bi::vector<JobSlot, ShmemAllocatorSlot> ShSlotVector;
+
+//  Name of the shared memory of the engine if none is given. Only one engine with this name can run at a time.
+static const char *const default_engine_name = "DRCleanEngine";
+
+//  Name of the named mutex or condition obj ("mux_inp", "mux_out", "cv_inp" or "cv_out") of the engine, so that
+//  several engines can run side by side.
+inline std::string sync_name(const std::string &segment_name, const char *obj)
+{
+    return segment_name + "." + obj;
+}
+
+//  Names of the segments holding the data and the results of the job with the given ticket.
+inline std::string job_name(const std::string &segment_name, unsigned ticket)
+{
+    return segment_name + ".job." + std::to_string(ticket);
+}
+
+//  A cleaned layer is published in up to max_result_parts parts, each in a segment of its own.
+inline std::string result_name(const std::string &segment_name, unsigned ticket, int part)
+{
+    return segment_name + ".result." + std::to_string(ticket) + "." + std::to_string(part);
+}
+
+static const int max_result_parts = 64;
+//  A layer which could not be cleaned is published as the part error_part with nparts -1 instead, whose header is
+//  followed by the message of the error terminated by a 0.
+static const int error_part = max_result_parts;
+//  Time the destructor of the master waits for the slave to finish the layers it is cleaning and to detach.
+static const int detach_timeout_ms = 2000;
+
+//  Header of the segment of a part of a cleaned layer, which is one block written at once with its final size. The
+//  header is followed by noffsets offsets and npoints points x,y, all ints, in the layout of
+//  DrcSl::get_polygons_flat(). Polygon j consists of the points offsets[j] to offsets[j+1]-1.
+//  The parts of a layer are horizontal stripes which are cut at y1 and y2, so their polygons never overlap and the
+//  parts can be used as soon as each of them arrives.
+struct ResultHeader
+{
+    int layer;
+    int datatype;
+    int noffsets;
+    int npoints;
+    int part;
+    int nparts;
+    //  Extent of the part.
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+};
+
+inline size_t result_size(size_t noffsets, size_t npoints)
+{
+    return sizeof(ResultHeader) + (noffsets + 2 * npoints) * sizeof(int);
+}
+
+//  Handshake between a master and a slave which is kept running for many cells, constructed by the master as "status".
+//  It is only read and changed with mux_inp locked. Whoever of the two is left last removes the shared memory of the
+//  engine and the segments of the layers and results: the master if the slave detached before the master was deleted,
+//  otherwise the slave once it finished its layers.
+struct EngineStatus
+{
+    //  Process of the master, the slave shuts down if it is gone.
+    int master_pid;
+    //  Process of the slave, 0 until the slave is ready to clean and again once it detached.
+    int slave_pid;
+    //  Set by the master to shut the slave down.
+    int stop;
+    //  Set by the master when it is deleted while the slave is still attached, which leaves the cleanup to the slave.
+    int master_gone;
+    //  Time of the last call of the slave, see now_ms().
+    long long heartbeat;
+    //  Layers the slave found in its cache and layers it had to clean.
+    long long cache_hits;
+    long long cache_misses;
+
+    EngineStatus(int pid): master_pid(pid), slave_pid(0), stop(0), master_gone(0), heartbeat(0), cache_hits(0), cache_misses(0) {};
+};
+
+//  Milliseconds of a monotonic clock, which is the same for all processes of the machine.
+inline long long now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//  Bounded queue of layer jobs in the shared memory, which is constructed by the master as "jobs". The master claims a
+//  free slot, writes the segment of the job and publishes it. The slave takes the published slots in the order they
+//  were claimed, reads the segment of the job and frees the slot again. The states of the slots are only read and
+//  changed with mux_inp locked.
+struct JobQueue
+{
+    ShSlotVector slots;
+    unsigned next_ticket;
+
+    JobQueue(int nslots, bi::managed_shared_memory::segment_manager *mgr): slots(nslots,JobSlot(),ShmemAllocatorSlot(mgr)),
+        next_ticket(0)
+    {
+    }
+
+    //  Claim a free slot for writing and give it the next ticket. Returns its index or -1 if all slots are in use.
+    int claim()
+    {
+        for(size_t i = 0; i < slots.size(); i++)
+        {
+            if(slots[i].state == JobSlot::free_slot)
+            {
+                slots[i].state = JobSlot::writing;
+                slots[i].ticket = next_ticket++;
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void publish(int i)
+    {
+        slots[i].state = JobSlot::ready;
+    }
+
+    //  Take the ready slot with the oldest ticket for reading. Returns its index or -1 if there is none.
+    int take()
+    {
+        int best = -1;
+        for(size_t i = 0; i < slots.size(); i++)
+        {
+            // The tickets are compared through their difference, so that they may wrap around.
+            if(slots[i].state == JobSlot::ready && (best < 0 || (int)(slots[i].ticket - slots[best].ticket) < 0))
+                best = i;
+        }
+        if(best >= 0)
+            slots[best].state = JobSlot::reading;
+        return best;
+    }
+
+    //  Free a slot after reading it or if writing it failed.
+    void release(int i)
+    {
+        slots[i].state = JobSlot::free_slot;
+    }
+
+    //  Number of slots which are not free.
+    int pending()
+    {
+        int n = 0;
+        for(size_t i = 0; i < slots.size(); i++)
+        {
+            n += slots[i].state != JobSlot::free_slot;
+        }
+        return n;
+    }
+};
+
+}
+
+#endif // JOBQUEUE_H
@@ -0,0 +1,230 @@
+//  This file is part of KLayoutPhotonicPCells, an extension for Photonic Layouts in KLayout.
+//  Copyright (c) 2018, Sebastian Goeldi
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "ResultCache.h"
+
+#include <cstdio>
+#include <unistd.h>
+
+namespace drclean
+{
+
+//  Header of a file of the cache directory, followed by n ints.
+struct CacheFileHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t h1;
+    uint64_t h2;
+    uint64_t n;
+};
+
+static const uint32_t cache_file_magic = 0x4b505243;
+static const uint32_t cache_file_version = 1;
+
+//    Final mixing step of splitmix64, so that every bit of the input affects every bit of the key.
+static inline uint64_t mix(uint64_t h)
+{
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+ResultCache::ResultCache(size_t capacity): capacity(capacity), nhits(0), nmisses(0)
+{
+}
+
+//    Key of a layer with the parameters params, which have to include everything the result depends on besides the
+//    data, and the n ints of data. The two halves of the key are hashed independently, so different layers practically
+//    never share a key.
+CacheKey ResultCache::key(const std::vector<int> &params, const int *data, size_t n)
+{
+    uint64_t h1 = 0xcbf29ce484222325ULL ^ params.size();
+    uint64_t h2 = 0x9e3779b97f4a7c15ULL ^ n;
+    auto add = [&h1,&h2](int v)
+    {
+        uint32_t w = v;
+        h1 = (h1 ^ w) * 0x100000001b3ULL;
+        h2 = (h2 + w) * 0xff51afd7ed558ccdULL;
+        h2 ^= h2 >> 29;
+    };
+    for(int p: params)
+        add(p);
+    for(size_t i = 0; i < n; i++)
+        add(data[i]);
+
+    CacheKey key;
+    key.h1 = mix(h1 ^ n);
+    key.h2 = mix(h2 ^ params.size());
+    return key;
+}
+
+//    Look up the result of key in memory and then in the directory. Returns whether it was found.
+bool ResultCache::get(const CacheKey &key, std::vector<int> &value)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mux);
+        std::unordered_map<CacheKey,Entries::iterator,CacheKeyHash>::iterator it = this->index.find(key);
+        if(it != this->index.end())
+        {
+            this->entries.splice(this->entries.begin(),this->entries,it->second);
+            value = it->second->second;
+            this->nhits++;
+            return true;
+        }
+    }
+    if(read_file(key,value))
+    {
+        std::lock_guard<std::mutex> lock(this->mux);
+        insert(key,value);
+        this->nhits++;
+        return true;
+    }
+    this->nmisses++;
+    return false;
+}
+
+//    Store the result of key in memory and, if a directory is set, in a file.
+void ResultCache::put(const CacheKey &key, const std::vector<int> &value)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mux);
+        insert(key,value);
+    }
+    write_file(key,value);
+}
+
+//    Add an entry as the most recently used one. Has to be called with mux locked.
+void ResultCache::insert(const CacheKey &key, const std::vector<int> &value)
+{
+    size_t size = value.size() * sizeof(int);
+    if(size > this->capacity || this->index.count(key))
+        return;
+    this->entries.emplace_front(key,value);
+    this->index[key] = this->entries.begin();
+    this->used += size;
+    shrink();
+}
+
+//    Drop the least recently used entries beyond the capacity. Has to be called with mux locked.
+void ResultCache::shrink()
+{
+    while(this->used > this->capacity)
+    {
+        this->used -= this->entries.back().second.size() * sizeof(int);
+        this->index.erase(this->entries.back().first);
+        this->entries.pop_back();
+    }
+}
+
+//    Whether results are kept at all, in memory or in the directory. Otherwise computing the key can be skipped.
+bool ResultCache::enabled()
+{
+    std::lock_guard<std::mutex> lock(this->mux);
+    return this->capacity > 0 || !this->directory.empty();
+}
+
+//    Limit the memory for results to capacity bytes, 0 keeps none in memory.
+void ResultCache::set_capacity(size_t capacity)
+{
+    std::lock_guard<std::mutex> lock(this->mux);
+    this->capacity = capacity;
+    shrink();
+}
+
+//    Keep the results in files in directory, which has to exist. An empty directory only keeps them in memory.
+void ResultCache::set_directory(const std::string &directory)
+{
+    std::lock_guard<std::mutex> lock(this->mux);
+    this->directory = directory;
+}
+
+//    Number of lookups that found a result.
+long long ResultCache::hits()
+{
+    return this->nhits;
+}
+
+//    Number of lookups that found none.
+long long ResultCache::misses()
+{
+    return this->nmisses;
+}
+
+//    File of key in the directory, or an empty string if there is no directory.
+std::string ResultCache::file_name(const CacheKey &key)
+{
+    std::lock_guard<std::mutex> lock(this->mux);
+    if(this->directory.empty())
+        return std::string();
+    char hex[33];
+    std::snprintf(hex,sizeof(hex),"%016llx%016llx",(unsigned long long)key.h1,(unsigned long long)key.h2);
+    return this->directory + "/" + hex + ".drc";
+}
+
+//    Read the result of key from its file. Files which are incomplete or of another version are ignored.
+bool ResultCache::read_file(const CacheKey &key, std::vector<int> &value)
+{
+    std::string name = file_name(key);
+    if(name.empty())
+        return false;
+    std::FILE *f = std::fopen(name.data(),"rb");
+    if(!f)
+        return false;
+    CacheFileHeader header;
+    bool ok = std::fread(&header,sizeof(header),1,f) == 1 && header.magic == cache_file_magic
+              && header.version == cache_file_version && header.h1 == key.h1 && header.h2 == key.h2;
+    // The size of the file is checked before the memory for the result is allocated.
+    ok = ok && std::fseek(f,0,SEEK_END) == 0 && (uint64_t)std::ftell(f) == sizeof(header) + header.n * sizeof(int)
+         && std::fseek(f,sizeof(header),SEEK_SET) == 0;
+    if(ok)
+    {
+        value.resize(header.n);
+        ok = std::fread(value.data(),sizeof(int),header.n,f) == header.n;
+    }
+    std::fclose(f);
+    return ok;
+}
+
+//    Write the result of key into its file. The file is written under a name of its own and renamed afterwards, so
+//    other threads and processes never read a file which is incomplete. The cache is only an optimisation, so errors
+//    are ignored. Nothing limits the size of the directory, files of results that are not used any more are only
+//    removed by deleting them by hand.
+void ResultCache::write_file(const CacheKey &key, const std::vector<int> &value)
+{
+    static std::atomic<unsigned> counter(0);
+
+    std::string name = file_name(key);
+    if(name.empty())
+        return;
+    std::string tmp = name + "." + std::to_string(getpid()) + "." + std::to_string(counter++) + ".tmp";
+    std::FILE *f = std::fopen(tmp.data(),"wb");
+    if(!f)
+        return;
+    CacheFileHeader header;
+    header.magic = cache_file_magic;
+    header.version = cache_file_version;
+    header.h1 = key.h1;
+    header.h2 = key.h2;
+    header.n = value.size();
+    bool ok = std::fwrite(&header,sizeof(header),1,f) == 1
+              && std::fwrite(value.data(),sizeof(int),value.size(),f) == value.size();
+    ok = std::fclose(f) == 0 && ok;
+    if(!ok || std::rename(tmp.data(),name.data()) != 0)
+        std::remove(tmp.data());
+}
+
+}
@@ -0,0 +1,106 @@
+//  This file is part of KLayoutPhotonicPCells, an extension for Photonic Layouts in KLayout.
+//  Copyright (c) 2018, Sebastian Goeldi
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+namespace drclean
+{
+
+//  Layout of the results, which is part of their key, so the results of different users of one directory never mix.
+enum CacheFormat
+{
+    //  Rectangles x1, y1, x2, y2 like DrcSl::get_rectangles().
+    cache_rectangles = 1,
+    //  Parts of a layer of the cleaner process, see CleanerSlave.
+    cache_parts = 2,
+};
+
+//  128 bit hash of the input of a layer, which addresses its result in the cache.
+struct CacheKey
+{
+    uint64_t h1;
+    uint64_t h2;
+
+    bool operator==(const CacheKey &other) const
+    {
+        return h1 == other.h1 && h2 == other.h2;
+    }
+};
+
+struct CacheKeyHash
+{
+    size_t operator()(const CacheKey &key) const
+    {
+        return key.h1;
+    }
+};
+
+//  Cleaned layers by the hash of their input, so a layer which is cleaned again with the same edges and rules is not
+//  cleaned a second time. The most recently used results are kept in memory up to capacity bytes. If a directory is
+//  set, every result is also stored there as a file named by its key, which keeps it across sessions and for other
+//  processes. The files are never removed, the directory grows with every new layer until it is cleared by hand. The
+//  cache can be used by several threads at once.
+class ResultCache
+{
+public:
+    ResultCache(size_t capacity = default_capacity);
+
+    static CacheKey key(const std::vector<int> &params, const int *data, size_t n);
+
+    bool get(const CacheKey &key, std::vector<int> &value);
+    void put(const CacheKey &key, const std::vector<int> &value);
+    bool enabled();
+    void set_capacity(size_t capacity);
+    void set_directory(const std::string &directory);
+    long long hits();
+    long long misses();
+
+    //  Memory for the results if none is given.
+    static const size_t default_capacity = 256 << 20;
+
+private:
+    typedef std::list<std::pair<CacheKey,std::vector<int>>> Entries;
+
+    //  Most recently used first.
+    Entries entries;
+    std::unordered_map<CacheKey,Entries::iterator,CacheKeyHash> index;
+    size_t capacity;
+    size_t used = 0;
+    std::string directory;
+    std::mutex mux;
+    std::atomic<long long> nhits;
+    std::atomic<long long> nmisses;
+
+    void insert(const CacheKey &key, const std::vector<int> &value);
+    void shrink();
+    std::string file_name(const CacheKey &key);
+    bool read_file(const CacheKey &key, std::vector<int> &value);
+    void write_file(const CacheKey &key, const std::vector<int> &value);
+};
+
+}
+
+#endif // RESULTCACHE_H
@@ -1,18 +1,152 @@
 # distutils: language=c++
 # cython: language_level=3
 
-from CleanerMaster cimport CleanerMaster
+from CleanerMaster cimport CleanerMaster, LayerResult
+from cpython.buffer cimport PyBUF_WRITABLE
 from libcpp.vector cimport vector
 from libcpp.pair cimport pair
+import numpy as np
+import itertools
+import os
 
 cdef extern from "<utility>" namespace "std" nogil:
     T move[T](T)
 
+_engines = itertools.count()
+
+
+cdef class SharedPart:
+    """Mapping of a result part in the shared memory. The part is unmapped and its segment removed when the last
+    reference to this object is gone, which keeps the :class:`PyCleanerMaster` alive until then.
+    """
+    cdef PyCleanerMaster master
+    cdef unsigned ticket
+    cdef int part
+
+    def __dealloc__(self):
+        if self.master is not None:
+            self.master.c_cc.release(self.ticket, self.part)
+
+
+cdef class SharedInts:
+    """Read only view of ints in the shared memory through the buffer protocol. Arrays created with
+    :func:`numpy.asarray` use the shared memory directly and keep this object alive, which holds the
+    :class:`SharedPart` the memory belongs to.
+    """
+    cdef SharedPart owner
+    cdef const int *data
+    cdef Py_ssize_t shape[1]
+    cdef Py_ssize_t strides[1]
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        if flags & PyBUF_WRITABLE:
+            raise BufferError('The results in the shared memory are read only')
+        self.strides[0] = sizeof(int)
+        buffer.buf = <char *> self.data
+        buffer.format = 'i'
+        buffer.internal = NULL
+        buffer.itemsize = sizeof(int)
+        buffer.len = self.shape[0] * sizeof(int)
+        buffer.ndim = 1
+        buffer.obj = self
+        buffer.readonly = 1
+        buffer.shape = self.shape
+        buffer.strides = self.strides
+        buffer.suboffsets = NULL
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
+
+cdef object shared_array(SharedPart owner, const int *data, size_t n):
+    cdef SharedInts view = SharedInts()
+    view.owner = owner
+    view.data = data
+    view.shape[0] = n
+    return np.asarray(view)
+
+
+cdef class PyLayerResult:
+    """Part of a cleaned layer of the cleaner process, which is mapped from the shared memory without copying it.
+
+    Polygon j consists of the points ``points[offsets[j]:offsets[j+1]]``, points is an N x 2 array of x, y. A layer is
+    published in nparts parts, which are horizontal stripes cut at the bottom and top of their extent, so the polygons
+    of all parts do not overlap. The shared memory stays mapped as long as the result or any of its arrays, or arrays
+    created from them without copying, are in use. The result can be used as a context manager which releases it.
+    """
+    cdef SharedPart owner
+    cdef readonly int layer
+    cdef readonly int datatype
+    cdef readonly int part
+    cdef readonly int nparts
+    cdef readonly tuple extent
+    cdef readonly object offsets
+    cdef readonly object points
+
+    def release(self):
+        """Drop the arrays of the result. Its shared memory is unmapped and freed as soon as no array taken from it
+        before is in use any more.
+        """
+        self.owner = None
+        self.offsets = None
+        self.points = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.release()
+
 cdef class PyCleanerMaster:
-    cdef CleanerMaster c_cc
+    """Master side of a cleaning engine in the shared memory.
+
+    :param name: name of the engine, which the cleanermain process has to be started with. A name that is unique to
+        this process is chosen if it is None, so several engines can run side by side.
+    :param slots: number of layers that can be queued at the same time
+    """
+    cdef CleanerMaster *c_cc
 
-    def __cint__(self, nlayers : int):
-        self.c_cc = CleanerMaster(nlayers)
+    def __cinit__(self, name : str = None, slots : int = 16):
+        if name is None:
+            name = f'DRCleanEngine.{os.getpid()}.{next(_engines)}'
+        self.c_cc = new CleanerMaster(slots, name.encode())
+
+    def __dealloc__(self):
+        # The destructor waits for the cleanermain process to finish the layers it is cleaning.
+        with nogil:
+            del self.c_cc
+
+    @property
+    def name(self):
+        """Name of the engine, which is passed to cleanermain."""
+        return self.c_cc.name().decode()
+
+    def wait_ready(self, timeout : int):
+        """Wait for the cleanermain process to attach to the engine.
+
+        :param timeout: milliseconds to wait
+        :return: whether the process is ready to clean
+        """
+        cdef int t = timeout
+        cdef bint res
+        with nogil:
+            res = self.c_cc.wait_ready(t)
+        return res
+
+    def alive(self, max_age : int = 1000):
+        """Whether the cleanermain process is attached and checked in within the last max_age milliseconds."""
+        return self.c_cc.alive(max_age)
+
+    def shutdown(self):
+        """Let the cleanermain process finish the layers it is cleaning and exit."""
+        self.c_cc.shutdown()
+
+    def cache_stats(self):
+        """Number of layers the cleanermain process found in its cache and of those it had to clean.
+
+        :return: tuple of hits and misses
+        """
+        return self.c_cc.cache_hits(), self.c_cc.cache_misses()
 
     def set_box(self, layer : int, datatype : int, violation_width : int, violation_space : int, x1 : int, x2 : int,
                 y1 : int, y2 : int):
@@ -21,16 +155,77 @@ cdef class PyCleanerMaster:
     def add_edge(self, x1 : int, x2 : int, y1 : int, y2 : int):
         self.c_cc.add_edge(x1, x2, y1, y2)
 
-    def done(self):
-        return self.c_cc.done()
+    def add_edges(self, edges):
+        """Add many edges at once. The C++ side copies them without holding the GIL.
+
+        :param edges: N x 4 array (or any buffer or sequence convertible to one) of x1, x2, y1, y2 per edge
+        """
+        cdef const int[:, ::1] view = np.ascontiguousarray(edges, dtype=np.int32).reshape(-1, 4)
+        cdef size_t n = view.shape[0]
+        if n:
+            with nogil:
+                self.c_cc.add_edges(&view[0, 0], n)
+
+    def done(self, timeout : int = 0):
+        """Queue the layer for the cleaner process.
+
+        :param timeout: milliseconds to wait for a free slot of the queue if all of them are in use
+        :return: true if the layer could not be queued and done has to be called again
+        """
+        cdef int t = timeout
+        cdef int res
+        with nogil:
+            res = self.c_cc.done(t)
+        return res
+
+    def result(self, timeout : int = 0):
+        """Map the next part of a cleaned layer from the shared memory without copying it. The parts of a layer can be
+        used as they arrive, while the cleaner process still writes the others.
 
-    def get_layer(self):
+        :param timeout: milliseconds to wait for the cleaner process to finish a part
+        :return: :class:`PyLayerResult`, or None if no part was finished in time
+        :raises RuntimeError: if the cleaner process could not clean the layer of the part
+        """
+        cdef LayerResult res
+        cdef int t = timeout
+        cdef bint found
+        with nogil:
+            found = self.c_cc.next_result(t, res)
+        if not found:
+            return None
+        cdef SharedPart owner = SharedPart()
+        owner.master = self
+        owner.ticket = res.ticket
+        owner.part = res.part
+        cdef PyLayerResult r = PyLayerResult()
+        r.owner = owner
+        r.layer = res.layer
+        r.datatype = res.datatype
+        r.part = res.part
+        r.nparts = res.nparts
+        r.extent = (res.x1, res.y1, res.x2, res.y2)
+        r.offsets = shared_array(owner, res.offsets, res.npolygons + 1 if res.npolygons else 0)
+        r.points = shared_array(owner, res.points, 2 * res.npoints).reshape(-1, 2)
+        return r
+
+    def get_layer(self, timeout : int = 0):
         # arr = np.array([[]], dtype=np.int)
         cdef vector[vector[int]] res
-        res = move(self.c_cc.get_layer())
+        cdef int t = timeout
+        with nogil:
+            res = move(self.c_cc.get_layer(t))
         return res
 
-    def polygons(self):
+    def polygons(self, timeout : int = 0):
+        """Polygons of the next part of a cleaned layer.
+
+        :param timeout: milliseconds to wait for the cleaner process to finish a part
+        :return: [(layer, datatype), (1, 0), (part, nparts)] as first entry followed by the polygons, [(-1,-1)] if none
+            was finished in time
+        :raises RuntimeError: if the cleaner process could not clean the layer of the part
+        """
         cdef vector[vector[pair[int,int]]] polygons
-        polygons = move(self.c_cc.get_polygons())
+        cdef int t = timeout
+        with nogil:
+            polygons = move(self.c_cc.get_polygons(t))
         return polygons
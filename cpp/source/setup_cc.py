@@ -8,8 +8,8 @@ from Cython.Distutils import build_ext
 
 ext_module = cythonize([Extension('cleanermaster',
                                   ['cleanermaster.pyx'],
-                                  extra_compile_args=["--std=c++14"],
-                                  extra_link_args=["--std=c++14"],
+                                  extra_compile_args=["--std=c++14", "-pthread"],
+                                  extra_link_args=["--std=c++14", "-pthread"],
                                   language='c++',
                                   libraries=['rt', 'boost_thread'],
                                   # libraries_dirs=['/lib/x86_64-linux-gnu/']
@@ -23,12 +23,49 @@
 
 
 from DrcSl cimport DrcSl
+from DrcEngine cimport DrcEngine
 import numpy as np
 
 # from DrcSl cimport edgecoord
 
 from libcpp cimport bool
 from libcpp.vector cimport vector
+from libcpp.pair cimport pair
+
+
+cdef class IntVector:
+    """Owner of a C++ vector of ints, which exposes the vector's memory through the buffer protocol. Arrays created with
+    :func:`numpy.asarray` use the memory of the vector directly and keep this object alive.
+    """
+    cdef vector[int] v
+    cdef Py_ssize_t shape[1]
+    cdef Py_ssize_t strides[1]
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        self.shape[0] = self.v.size()
+        self.strides[0] = sizeof(int)
+        buffer.buf = <char *> self.v.data()
+        buffer.format = 'i'
+        buffer.internal = NULL
+        buffer.itemsize = sizeof(int)
+        buffer.len = self.v.size() * sizeof(int)
+        buffer.ndim = 1
+        buffer.obj = self
+        buffer.readonly = 0
+        buffer.shape = self.shape
+        buffer.strides = self.strides
+        buffer.suboffsets = NULL
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
+
+cdef object as_array(vector[int] &v):
+    """Move v into a numpy array without copying its data."""
+    cdef IntVector holder = IntVector()
+    holder.v.swap(v)
+    return np.asarray(holder)
+
 
 cdef class PyDrcSl:
     cdef DrcSl c_sl
@@ -48,6 +85,30 @@ cdef class PyDrcSl:
         """
         self.c_sl.add_data(x1, x2, y1, y2)
 
+    def add_edges(self, edges):
+        """Insert many edges at once, see :meth:`add_data`. The GIL is released while the edges are rasterised.
+
+        :param edges: N x 4 array (or any buffer or sequence convertible to one) of x1, x2, y1, y2 per edge
+        """
+        cdef const int[:, ::1] view = np.ascontiguousarray(edges, dtype=np.int32).reshape(-1, 4)
+        cdef size_t n = view.shape[0]
+        if n:
+            with nogil:
+                self.c_sl.add_edges(&view[0, 0], n)
+
+    def add_polygon(self, points):
+        """Insert a closed contour into the scanline cleaner. This is the same as adding all of its edges with
+        :meth:`add_data`, but with one call for the whole contour. The GIL is released while the contour is rasterised.
+
+        :param points: N x 2 array (or any buffer or sequence convertible to one) of the x, y points of the contour, the
+            last point is connected to the first one
+        """
+        cdef const int[:, ::1] view = np.ascontiguousarray(points, dtype=np.int32).reshape(-1, 2)
+        cdef size_t n = view.shape[0]
+        if n:
+            with nogil:
+                self.c_sl.add_polygon(&view[0, 0], n)
+
     def init_list(self, x1: int, x2: int, y1: int, y2: int, viospace: int, viowidth: int):
         """(Re-)Initialize the Cleaner. x1,2 and y1,2 define the bounding box of the cleaner.
 
@@ -70,6 +131,13 @@ cdef class PyDrcSl:
         """
         self.c_sl.sortlist()
 
+    def set_threads(self, n: int):
+        """Use n threads to add, sort and clean the data. Only large layers are split up.
+
+        :param n: number of threads
+        """
+        self.c_sl.set_threads(n)
+
     def clean(self, x: int = 10):
         """Clean data in the vector for space and width violations
 
@@ -96,6 +164,54 @@ cdef class PyDrcSl:
         res = self.c_sl.get_vect(ind)
         return np.array(res, dtype=int)
 
+    def get_runs(self):
+        """Get all rows at once. Rows with the same edges are returned once as a run of rows.
+
+        :return: numpy arrays y, h, offsets, x. Run k covers the rows y[k] to y[k]+h[k]-1, which all have the edges
+            x[offsets[k]:offsets[k+1]], alternating begin and end of an interval like in :meth:`get_row`.
+        """
+        cdef vector[int] y
+        cdef vector[int] h
+        cdef vector[int] off
+        cdef vector[int] x
+        self.c_sl.get_runs(y, h, off, x)
+        return as_array(y), as_array(h), as_array(off), as_array(x)
+
+    def get_lines(self):
+        """Get the edges of all rows (or columns) of the cleaner's array as a list with one list per row.
+
+        :return: list of lists of edges
+        """
+        return self.c_sl.get_lines()
+
+    def polygons(self):
+        """Assemble the rows to polygons.
+
+        :return: polygons in the form [[(x1,y1),(x2,y2),...],...]
+        """
+        return self.c_sl.get_polygons()
+
+    def get_polygons_flat(self):
+        """Assemble the rows to polygons and return them at once.
+
+        :return: numpy arrays offsets and points. Polygon j consists of the points points[offsets[j]:offsets[j+1]],
+            points is an N x 2 array of x, y.
+        """
+        cdef vector[int] off
+        cdef vector[int] points
+        self.c_sl.get_polygons_flat(off, points)
+        return as_array(off), as_array(points).reshape(-1, 2)
+
+    def get_rectangles(self):
+        """Cover the cleaned data with rectangles which do not overlap. Each rectangle is extended upwards as far as the
+        rows have the same interval. The output is already merged, it can be inserted into a layout without merging it.
+
+        :return: N x 4 numpy array of x1, y1, x2, y2 per rectangle
+        """
+        cdef vector[int] rects
+        self.c_sl.get_rectangles(rects)
+        return as_array(rects).reshape(-1, 4)
+
     def get_row_types(self, ind: int):
         """Get the type of edges in that row.
 
@@ -132,3 +248,123 @@ cdef class PyDrcSl:
     @s.setter
     def s(self, s):
         raise ValueError('cannot set the dimensions. it is automatically calculated')
+
+
+cdef class PyDrcEngine:
+    """Cleans all layers of a cell in this process. The layers are cleaned concurrently on a thread pool with the GIL
+    released. The threads are kept until the engine is deleted, so one engine should be used for many cells.
+
+    :param threads: number of threads, all cores of the machine if smaller than one
+    """
+    cdef DrcEngine *c_engine
+
+    def __cinit__(self, threads: int = 0):
+        self.c_engine = new DrcEngine(threads)
+
+    def __dealloc__(self):
+        del self.c_engine
+
+    def add_layer(self, layer: int, datatype: int, violation_width: int, violation_space: int, x1: int, x2: int,
+                  y1: int, y2: int, edges, instances=None):
+        """Add a layer to clean with the next :meth:`run`.
+
+        :param layer: layer number
+        :param datatype: datatype of the layer
+        :param violation_width: minimum width in database units
+        :param violation_space: minimum space in database units
+        :param x1: left bound of the layer
+        :param x2: right bound of the layer
+        :param y1: bottom bound of the layer
+        :param y2: top bound of the layer
+        :param edges: N x 4 array (or any buffer or sequence convertible to one) of x1, x2, y1, y2 per edge
+        :param instances: M x 3 array of cell, dx, dy per instance of a cell of :meth:`add_cell` which is placed on
+            the layer as well, the bounds have to include them. Each cell is only cleaned once for all its instances.
+        :return: index of the layer
+        """
+        cdef const int[:, ::1] view = np.ascontiguousarray(edges, dtype=np.int32).reshape(-1, 4)
+        cdef size_t n = view.shape[0]
+        cdef const int *data = &view[0, 0] if n else NULL
+        if instances is None:
+            return self.c_engine.add_layer(layer, datatype, violation_width, violation_space, x1, x2, y1, y2, data, n)
+
+        cdef const int[:, ::1] inst = np.ascontiguousarray(instances, dtype=np.int32).reshape(-1, 3)
+        cdef size_t m = inst.shape[0]
+        cdef const int *inst_data = &inst[0, 0] if m else NULL
+        return self.c_engine.add_layer(layer, datatype, violation_width, violation_space, x1, x2, y1, y2, data, n,
+                                       inst_data, m)
+
+    def add_cell(self, x1: int, x2: int, y1: int, y2: int, edges):
+        """Add the geometry of a cell on one layer, which layers of :meth:`add_layer` can place by instances. A cell in
+        another orientation has to be added as a cell of its own.
+
+        :param x1: left bound of the cell
+        :param x2: right bound of the cell
+        :param y1: bottom bound of the cell
+        :param y2: top bound of the cell
+        :param edges: N x 4 array of x1, x2, y1, y2 per edge in the coordinates of the cell
+        :return: index of the cell
+        """
+        cdef const int[:, ::1] view = np.ascontiguousarray(edges, dtype=np.int32).reshape(-1, 4)
+        cdef size_t n = view.shape[0]
+        cdef const int *data = &view[0, 0] if n else NULL
+        return self.c_engine.add_cell(x1, x2, y1, y2, data, n)
+
+    def run(self, max_tries: int = 10):
+        """Clean all layers that were added. The GIL is released until all of them are done.
+
+        :param max_tries: number of max tries of each cleaning step
+        """
+        cdef int tries = max_tries
+        with nogil:
+            self.c_engine.run(tries)
+
+    def get_layer(self, ind: int):
+        """Layer and datatype of a layer.
+
+        :param ind: index of the layer
+        :return: tuple of layer and datatype
+        """
+        return self.c_engine.get_layer(ind)
+
+    def get_rectangles(self, ind: int):
+        """Rectangles of a cleaned layer, like :meth:`PyDrcSl.get_rectangles`. They can only be retrieved once.
+
+        :param ind: index of the layer
+        :return: N x 4 numpy array of x1, y1, x2, y2 per rectangle
+        """
+        cdef vector[int] rects
+        self.c_engine.get_rectangles(ind, rects)
+        return as_array(rects).reshape(-1, 4)
+
+    def clear(self):
+        """Remove all layers and cells. The threads are kept for the next cell.
+        """
+        self.c_engine.clear()
+
+    @property
+    def threads(self):
+        """Number of threads the layers are cleaned with.
+
+        :rtype: int
+        """
+        return self.c_engine.threads()
+
+    def set_cache(self, memory: int, directory: str = ''):
+        """Configure the cache of cleaned layers. A layer which was cleaned before with the same edges, bounding box and
+        rules is taken from the cache instead of being cleaned again.
+
+        :param memory: bytes of cleaned layers to keep in memory, 0 keeps none
+        :param directory: existing directory to keep the cleaned layers in across sessions, empty to not use one
+        """
+        self.c_engine.cache().set_capacity(memory)
+        self.c_engine.cache().set_directory(directory.encode())
+
+    def cache_stats(self):
+        """Number of layers that were found in the cache and of those that were not.
+
+        :return: tuple of hits and misses
+        """
+        return self.c_engine.cache().hits(), self.c_engine.cache().misses()
+
+    def __len__(self):
+        return self.c_engine.size()
@@ -0,0 +1,226 @@
+//  This file is part of KLayoutPhotonicPCells, an extension for Photonic Layouts in KLayout.
+//  Copyright (c) 2018, Sebastian Goeldi
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+//  Differential test of the hierarchical cleaning of DrcEngine. Each seed builds a few child cells of random rectangles
+//  and places them with overlapping instances next to some shapes of the layer itself. The flattened layer and the
+//  layer with instances are cleaned by the same engine. The violations left in both are counted with the space and
+//  width passes of DrcSl in rows and columns, and the hierarchical result must not have more of them than the flat one.
+//  Its rectangles must not overlap either.
+//
+//    Usage: drcengine_test [nseeds [first_seed]]
+
+#include "DrcEngine.h"
+
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace drclean;
+
+//  Child cell with its bounding box and rectangles x1, y1, x2, y2.
+struct Cell
+{
+    int box[4];
+    std::vector<int> rects;
+};
+
+//    Append the edges of the rectangles x1, y1, x2, y2 moved by dx, dy to edges, the left side upwards and the right
+//    side downwards.
+static void rect_edges(const std::vector<int> &rects, int dx, int dy, std::vector<int> &edges)
+{
+    for(size_t i = 0; i < rects.size(); i += 4)
+    {
+        int x1 = rects[i] + dx;
+        int y1 = rects[i+1] + dy;
+        int x2 = rects[i+2] + dx;
+        int y2 = rects[i+3] + dy;
+        edges.insert(edges.end(),{x1,x1,y1,y2,x2,x2,y2,y1});
+    }
+}
+
+//    Violations of the space and width rules left in the rectangles, counted by the passes of DrcSl in rows and in
+//    columns. Each pass runs on a copy of its own, so none of them sees the fixes of another.
+static int violations(const std::vector<int> &rects, const int *box, int space, int width)
+{
+    std::vector<int> edges;
+    rect_edges(rects,0,0,edges);
+    DrcSl sl;
+    sl.initialize_list(box[0],box[2],box[1],box[3],space,width);
+    sl.add_edges(edges.data(),edges.size() / 4);
+    sl.sortlist();
+
+    int n = 0;
+    for(int orientation = 0; orientation < 2; orientation++)
+    {
+        DrcSl s(sl);
+        DrcSl w(sl);
+        if(orientation)
+        {
+            s.switch_dimensions();
+            w.switch_dimensions();
+        }
+        n += s.clean_space() + w.clean_width();
+    }
+    return n;
+}
+
+//    Whether any two of the rectangles share an area.
+static bool overlapping(const std::vector<int> &rects)
+{
+    std::vector<size_t> order;
+    for(size_t i = 0; i < rects.size(); i += 4)
+        order.push_back(i);
+    std::sort(order.begin(),order.end(),[&rects](size_t a, size_t b)
+    {
+        return rects[a] < rects[b];
+    });
+    for(size_t a = 0; a < order.size(); a++)
+    {
+        const int *p = &rects[order[a]];
+        for(size_t b = a + 1; b < order.size() && rects[order[b]] < p[2]; b++)
+        {
+            const int *q = &rects[order[b]];
+            if(q[1] < p[3] && p[1] < q[3] && q[0] < p[2] && p[0] < q[2])
+                return true;
+        }
+    }
+    return false;
+}
+
+//    Cleans the layout of seed flat and with instances. Returns an empty string or what is wrong.
+static std::string test_seed(unsigned seed)
+{
+    std::mt19937 rng(seed);
+    auto rnd = [&rng](int n)
+    {
+        return (int)(rng() % (unsigned)std::max(1,n));
+    };
+    static const int rules[3][2] = {{6,6},{10,4},{3,15}};
+    int width = rules[seed % 3][0];
+    int space = rules[seed % 3][1];
+    int size = 1500;
+
+    std::vector<Cell> cells(3);
+    for(Cell &c: cells)
+    {
+        int cw = 60 + rnd(240);
+        int ch = 60 + rnd(240);
+        int n = 3 + rnd(22);
+        for(int k = 0; k < n; k++)
+        {
+            int x = rnd(cw - 5);
+            int y = rnd(ch - 5);
+            c.rects.insert(c.rects.end(),{x,y,std::min(cw,x + 1 + rnd(60)),std::min(ch,y + 1 + rnd(60))});
+        }
+        c.box[0] = c.box[1] = 1 << 30;
+        c.box[2] = c.box[3] = -(1 << 30);
+        for(size_t i = 0; i < c.rects.size(); i += 4)
+        {
+            c.box[0] = std::min(c.box[0],c.rects[i]);
+            c.box[1] = std::min(c.box[1],c.rects[i+1]);
+            c.box[2] = std::max(c.box[2],c.rects[i+2]);
+            c.box[3] = std::max(c.box[3],c.rects[i+3]);
+        }
+    }
+
+    // Instances close enough to each other to overlap, and a few shapes of the layer itself.
+    static const int counts[3] = {2,8,25};
+    std::vector<int> instances;
+    for(int k = counts[rnd(3)]; k > 0; k--)
+        instances.insert(instances.end(),{rnd(3),rnd(size - 320),rnd(size - 320)});
+    std::vector<int> own;
+    for(int k = rnd(6); k > 0; k--)
+    {
+        int x = rnd(size - 100);
+        int y = rnd(size - 100);
+        own.insert(own.end(),{x,y,x + 1 + rnd(100),y + 1 + rnd(100)});
+    }
+
+    std::vector<int> flat = own;
+    for(size_t k = 0; k < instances.size(); k += 3)
+    {
+        const Cell &c = cells[instances[k]];
+        for(size_t i = 0; i < c.rects.size(); i += 4)
+        {
+            flat.insert(flat.end(),{c.rects[i] + instances[k+1],c.rects[i+1] + instances[k+2],
+                                    c.rects[i+2] + instances[k+1],c.rects[i+3] + instances[k+2]});
+        }
+    }
+    int box[4] = {1 << 30,1 << 30,-(1 << 30),-(1 << 30)};
+    for(size_t i = 0; i < flat.size(); i += 4)
+    {
+        box[0] = std::min(box[0],flat[i]);
+        box[1] = std::min(box[1],flat[i+1]);
+        box[2] = std::max(box[2],flat[i+2]);
+        box[3] = std::max(box[3],flat[i+3]);
+    }
+
+    DrcEngine engine(1);
+    engine.cache().set_capacity(0);
+    std::vector<int> edges;
+    rect_edges(flat,0,0,edges);
+    engine.add_layer(1,0,width,space,box[0],box[2],box[1],box[3],edges.data(),edges.size() / 4);
+    std::vector<int> ids;
+    for(const Cell &c: cells)
+    {
+        edges.clear();
+        rect_edges(c.rects,0,0,edges);
+        ids.push_back(engine.add_cell(c.box[0],c.box[2],c.box[1],c.box[3],edges.data(),edges.size() / 4));
+    }
+    for(size_t k = 0; k < instances.size(); k += 3)
+        instances[k] = ids[instances[k]];
+    edges.clear();
+    rect_edges(own,0,0,edges);
+    engine.add_layer(1,0,width,space,box[0],box[2],box[1],box[3],edges.data(),edges.size() / 4,instances.data(),
+                     instances.size() / 3);
+    engine.run();
+
+    std::vector<int> flat_rects;
+    std::vector<int> hier_rects;
+    engine.get_rectangles(0,flat_rects);
+    engine.get_rectangles(1,hier_rects);
+    if(overlapping(hier_rects))
+        return "the hierarchical rectangles overlap";
+    int flat_violations = violations(flat_rects,box,space,width);
+    int hier_violations = violations(hier_rects,box,space,width);
+    if(hier_violations > flat_violations)
+    {
+        return std::to_string(hier_violations) + " violations are left hierarchically, " +
+               std::to_string(flat_violations) + " flat";
+    }
+    return "";
+}
+
+int main(int argc, char* argv[])
+{
+    int nseeds = argc > 1 ? std::atoi(argv[1]) : 300;
+    unsigned first = argc > 2 ? (unsigned)std::atoi(argv[2]) : 0;
+    int failed = 0;
+    for(unsigned seed = first; seed < first + nseeds; seed++)
+    {
+        std::string error = test_seed(seed);
+        if(!error.empty())
+        {
+            std::printf("seed %u: %s\n",seed,error.c_str());
+            failed++;
+        }
+    }
+    std::printf("drcengine_test: %d of %d seeds failed\n",failed,nseeds);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,275 @@
+//  This file is part of KLayoutPhotonicPCells, an extension for Photonic Layouts in KLayout.
+//  Copyright (c) 2018, Sebastian Goeldi
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+//  Differential test of DrcSl. Seeded random layouts are cleaned serially, with several threads and in bands with
+//  clean_tiled(). The edges are added with add_data(), add_edges() and add_polygon() respectively. All three have to
+//  end up with the same scanlines. The rectangles of get_rectangles() and the polygons of get_polygons_flat() must not
+//  overlap and must cover the same area.
+//
+//    Usage: drcsl_test [nseeds [first_seed]]
+
+#include "DrcSl.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <random>
+#include <thread>
+#include <algorithm>
+#include <exception>
+#include <cstdio>
+#include <cstdlib>
+
+using namespace drclean;
+
+//  Closed contour x0,y0,x1,y1,... which runs clockwise.
+typedef std::vector<int> Contour;
+
+//  Seeded layout and its rules.
+struct Layout
+{
+    int width;
+    int height;
+    int space;
+    int min_width;
+    std::vector<Contour> contours;
+};
+
+//    Runs fn(0) to fn(n-1) on a thread each, like the ParallelFor of the cleaner process.
+static void spawn(int n, const std::function<void(int)> &fn)
+{
+    std::vector<std::exception_ptr> errors(n);
+    std::vector<std::thread> threads;
+    for(int i = 0; i < n; i++)
+    {
+        threads.emplace_back([&fn,&errors,i]()
+        {
+            try
+            {
+                fn(i);
+            }
+            catch(...)
+            {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for(std::thread &t: threads)
+        t.join();
+    for(std::exception_ptr &e: errors)
+    {
+        if(e)
+            std::rethrow_exception(e);
+    }
+}
+
+//    Random rectangles, trapezoids and triangles. Every fourth seed is large enough for the threaded kernels, which only
+//    run on more than DrcSl::parallel_min_edges edges.
+static Layout make_layout(unsigned seed)
+{
+    std::mt19937 rng(seed);
+    auto rnd = [&rng](int n)
+    {
+        return (int)(rng() % (unsigned)std::max(1,n));
+    };
+    Layout l;
+    bool large = seed % 4 == 0;
+    l.width = large ? 3000 + rnd(2000) : 40 + rnd(400);
+    l.height = large ? 3000 + rnd(2000) : 40 + rnd(400);
+    l.space = 2 + rnd(8);
+    l.min_width = 2 + rnd(8);
+    int n = large ? 6000 : 1 + rnd(40);
+    int size = large ? 40 : 80;
+    for(int k = 0; k < n; k++)
+    {
+        int x1 = rnd(l.width - 4);
+        int y1 = rnd(l.height - 4);
+        int w = 2 + rnd(std::min(size,l.width - x1 - 2));
+        int h = 2 + rnd(std::min(size,l.height - y1 - 2));
+        int t = rnd(4);
+        if(t < 2)
+            l.contours.push_back(Contour{x1,y1,x1,y1 + h,x1 + w,y1 + h,x1 + w,y1});
+        else if(t == 2)
+        {
+            int d = rnd(w / 2);
+            l.contours.push_back(Contour{x1,y1,x1 + d,y1 + h,x1 + w - d,y1 + h,x1 + w,y1});
+        }
+        else
+            l.contours.push_back(Contour{x1,y1,x1,y1 + h,x1 + w,y1 + h / 2});
+    }
+    return l;
+}
+
+//    Edges x1,x2,y1,y2 of all contours in the layout of add_data().
+static std::vector<int> edges(const Layout &l)
+{
+    std::vector<int> e;
+    for(const Contour &c: l.contours)
+    {
+        size_t n = c.size() / 2;
+        for(size_t j = 0; j < n; j++)
+        {
+            size_t k = (j + 1) % n;
+            e.insert(e.end(),{c[2*j],c[2*k],c[2*j+1],c[2*k+1]});
+        }
+    }
+    return e;
+}
+
+//    Intervals of each scanline from the vertical edges of a polygon, which are paired up by their x.
+static void add_polygon_rows(const int *points, int n, std::map<int,std::vector<std::pair<int,int>>> &rows)
+{
+    std::map<int,std::vector<int>> xs;
+    for(int j = 0; j < n; j++)
+    {
+        int k = (j + 1) % n;
+        if(points[2*j] != points[2*k])
+            continue;
+        int y1 = std::min(points[2*j+1],points[2*k+1]);
+        int y2 = std::max(points[2*j+1],points[2*k+1]);
+        for(int y = y1; y < y2; y++)
+            xs[y].push_back(points[2*j]);
+    }
+    for(std::pair<const int,std::vector<int>> &row: xs)
+    {
+        std::sort(row.second.begin(),row.second.end());
+        for(size_t k = 0; k + 1 < row.second.size(); k += 2)
+            rows[row.first].emplace_back(row.second[k],row.second[k+1]);
+    }
+}
+
+//    Sorts the intervals of each scanline and checks that none of them overlap. Touching intervals are merged.
+static bool disjoint(std::map<int,std::vector<std::pair<int,int>>> &rows)
+{
+    for(std::pair<const int,std::vector<std::pair<int,int>>> &row: rows)
+    {
+        std::vector<std::pair<int,int>> &v = row.second;
+        std::sort(v.begin(),v.end());
+        std::vector<std::pair<int,int>> merged;
+        for(const std::pair<int,int> &i: v)
+        {
+            if(i.first >= i.second)
+                continue;
+            if(!merged.empty() && i.first < merged.back().second)
+                return false;
+            if(!merged.empty() && i.first == merged.back().second)
+                merged.back().second = i.second;
+            else
+                merged.push_back(i);
+        }
+        v.swap(merged);
+    }
+    return true;
+}
+
+//    Scanlines of the cleaner from below to above its box.
+static std::vector<std::vector<int>> scanlines(DrcSl &sl)
+{
+    std::vector<std::vector<int>> v;
+    for(int y = sl.ver1 - 2; y <= sl.ver2 + 2; y++)
+        v.push_back(sl.get_vect(y));
+    return v;
+}
+
+//    Checks the outputs of a cleaned layer. Returns an empty string or what is wrong.
+static std::string check_outputs(DrcSl &sl)
+{
+    std::vector<int> rects;
+    sl.get_rectangles(rects);
+    std::map<int,std::vector<std::pair<int,int>>> rect_rows;
+    for(size_t i = 0; i + 3 < rects.size(); i += 4)
+    {
+        for(int y = rects[i+1]; y < rects[i+3]; y++)
+            rect_rows[y].emplace_back(rects[i],rects[i+2]);
+    }
+    if(!disjoint(rect_rows))
+        return "rectangles overlap";
+
+    std::vector<int> off;
+    std::vector<int> points;
+    sl.get_polygons_flat(off,points);
+    std::map<int,std::vector<std::pair<int,int>>> poly_rows;
+    for(size_t j = 0; j + 1 < off.size(); j++)
+        add_polygon_rows(points.data() + 2 * off[j],off[j+1] - off[j],poly_rows);
+    if(!disjoint(poly_rows))
+        return "polygons overlap";
+
+    for(std::map<int,std::vector<std::pair<int,int>>>::iterator it = rect_rows.begin(); it != rect_rows.end();)
+        it = it->second.empty() ? rect_rows.erase(it) : std::next(it);
+    for(std::map<int,std::vector<std::pair<int,int>>>::iterator it = poly_rows.begin(); it != poly_rows.end();)
+        it = it->second.empty() ? poly_rows.erase(it) : std::next(it);
+    if(rect_rows != poly_rows)
+        return "rectangles and polygons cover different areas";
+    return "";
+}
+
+//    Cleans the layout of seed in the three ways and compares them. Returns an empty string or what is wrong.
+static std::string test_seed(unsigned seed)
+{
+    Layout l = make_layout(seed);
+    std::vector<int> e = edges(l);
+
+    DrcSl serial;
+    serial.initialize_list(0,l.width,0,l.height,l.space,l.min_width);
+    for(size_t i = 0; i < e.size(); i += 4)
+        serial.add_data(e[i],e[i+1],e[i+2],e[i+3]);
+    serial.sortlist();
+    serial.clean();
+
+    DrcSl threaded;
+    threaded.initialize_list(0,l.width,0,l.height,l.space,l.min_width);
+    threaded.set_threads(4);
+    threaded.add_edges(e.data(),e.size() / 4);
+    threaded.sortlist();
+    threaded.clean();
+
+    DrcSl tiled;
+    tiled.initialize_list(0,l.width,0,l.height,l.space,l.min_width);
+    for(const Contour &c: l.contours)
+        tiled.add_polygon(c.data(),c.size() / 2);
+    tiled.sortlist();
+    int nbands = std::max(2,std::min(4,(tiled.ver2 - tiled.ver1) / (4 * tiled.halo())));
+    tiled.clean_tiled(nbands,spawn);
+
+    std::vector<std::vector<int>> reference = scanlines(serial);
+    if(scanlines(threaded) != reference)
+        return "set_threads(4) differs from the serial result";
+    if(scanlines(tiled) != reference)
+        return "clean_tiled(" + std::to_string(nbands) + ") differs from the serial result";
+
+    std::string error = check_outputs(serial);
+    if(error.empty())
+        error = check_outputs(threaded);
+    return error;
+}
+
+int main(int argc, char* argv[])
+{
+    int nseeds = argc > 1 ? std::atoi(argv[1]) : 200;
+    unsigned first = argc > 2 ? (unsigned)std::atoi(argv[2]) : 1;
+    int failed = 0;
+    for(unsigned seed = first; seed < first + nseeds; seed++)
+    {
+        std::string error = test_seed(seed);
+        if(!error.empty())
+        {
+            std::printf("seed %u: %s\n",seed,error.c_str());
+            failed++;
+        }
+    }
+    std::printf("drcsl_test: %d of %d seeds failed\n",failed,nseeds);
+    return failed ? 1 : 0;
+}
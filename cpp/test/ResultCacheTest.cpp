@@ -0,0 +1,328 @@
+//  This file is part of KLayoutPhotonicPCells, an extension for Photonic Layouts in KLayout.
+//  Copyright (c) 2018, Sebastian Goeldi
+//
+//    This program is free software: you can redistribute it and/or modify
+//    it under the terms of the GNU Affero General Public License as
+//    published by the Free Software Foundation, either version 3 of the
+//    License, or (at your option) any later version.
+//
+//    This program is distributed in the hope that it will be useful,
+//    but WITHOUT ANY WARRANTY; without even the implied warranty of
+//    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//    GNU Affero General Public License for more details.
+//
+//    You should have received a copy of the GNU Affero General Public License
+//    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+//  Test of ResultCache. Each seed builds a random layer and checks that a layer cleaned again by DrcEngine is taken
+//  from the cache with the same rectangles, that results in the layout of the cleaner process come back unchanged,
+//  that the least recently used results are dropped at the capacity, that results written to a directory are found
+//  by a second cache, that files which are truncated or of another version are ignored, and that the keys of
+//  DrcEngine and of the cleaner process for the same layer differ, so both can share a directory.
+//
+//    Usage: resultcache_test [nseeds [first_seed]]
+
+#include "DrcEngine.h"
+#include "ResultCache.h"
+
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace drclean;
+
+//  Random layer of rectangles with its box and rules, as DrcEngine and the cleaner process get it.
+struct Layer
+{
+    int box[4];
+    int width;
+    int space;
+    std::vector<int> edges;
+};
+
+//    Layer of up to 60 random rectangles.
+static Layer random_layer(std::mt19937 &rng)
+{
+    Layer l;
+    l.width = 3 + rng() % 8;
+    l.space = 3 + rng() % 8;
+    l.box[0] = l.box[1] = 0;
+    l.box[2] = l.box[3] = 1000;
+    for(int k = 1 + rng() % 60; k > 0; k--)
+    {
+        int x1 = rng() % 900;
+        int y1 = rng() % 900;
+        int x2 = x1 + 1 + rng() % 100;
+        int y2 = y1 + 1 + rng() % 100;
+        l.edges.insert(l.edges.end(),{x1,x1,y1,y2,x2,x2,y2,y1});
+    }
+    return l;
+}
+
+//    Random result of n ints.
+static std::vector<int> random_value(std::mt19937 &rng, size_t n)
+{
+    std::vector<int> value(n);
+    for(int &v: value)
+        v = (int)rng();
+    return value;
+}
+
+//    Result in the layout of the cleaner process: nparts, then per part its extent, the numbers of offsets and
+//    points, the offsets and the points.
+static std::vector<int> random_parts(std::mt19937 &rng)
+{
+    int nparts = 1 + rng() % 4;
+    std::vector<int> value(1,nparts);
+    for(int part = 0; part < nparts; part++)
+    {
+        int npolygons = rng() % 20;
+        std::vector<int> off(1,0);
+        for(int j = 0; j < npolygons; j++)
+            off.push_back(off.back() + 4 + rng() % 8);
+        std::vector<int> points = random_value(rng,2 * off.back());
+        int sizes[] = {0,250 * part,1000,250 * (part + 1),(int)off.size(),(int)points.size() / 2};
+        value.insert(value.end(),sizes,sizes + 6);
+        value.insert(value.end(),off.begin(),off.end());
+        value.insert(value.end(),points.begin(),points.end());
+    }
+    return value;
+}
+
+//    Keys of the layer as DrcEngine::clean_layer() and CleanerSlave::threaded_DrcSl() compute them.
+static CacheKey engine_key(const Layer &l, int max_tries)
+{
+    std::vector<int> params{cache_rectangles,l.box[0],l.box[2],l.box[1],l.box[3],l.space,l.width,max_tries};
+    return ResultCache::key(params,l.edges.data(),l.edges.size());
+}
+
+static CacheKey slave_key(const Layer &l)
+{
+    std::vector<int> inp{l.box[0],l.box[2],l.box[1],l.box[3],l.space,l.width};
+    inp.insert(inp.end(),l.edges.begin(),l.edges.end());
+    return ResultCache::key(std::vector<int>{cache_parts},inp.data(),inp.size());
+}
+
+//    File of key in directory, named like ResultCache::file_name().
+static std::string file_name(const std::string &directory, const CacheKey &key)
+{
+    char hex[33];
+    std::snprintf(hex,sizeof(hex),"%016llx%016llx",(unsigned long long)key.h1,(unsigned long long)key.h2);
+    return directory + "/" + hex + ".drc";
+}
+
+//    Remove the files of directory and directory itself.
+static void remove_directory(const std::string &directory)
+{
+    DIR *dir = opendir(directory.data());
+    if(dir)
+    {
+        while(dirent *entry = readdir(dir))
+        {
+            std::string name = entry->d_name;
+            if(name != "." && name != "..")
+                std::remove((directory + "/" + name).data());
+        }
+        closedir(dir);
+    }
+    rmdir(directory.data());
+}
+
+//    Cleans the layer twice with one engine. The second run has to be a hit with the same rectangles.
+static std::string test_engine_hit(const Layer &l)
+{
+    DrcEngine engine(1);
+    std::vector<int> rects[2];
+    for(int run = 0; run < 2; run++)
+    {
+        engine.clear();
+        engine.add_layer(1,0,l.width,l.space,l.box[0],l.box[2],l.box[1],l.box[3],l.edges.data(),l.edges.size() / 4);
+        engine.run();
+        engine.get_rectangles(0,rects[run]);
+    }
+    if(engine.cache().hits() != 1 || engine.cache().misses() != 1)
+    {
+        return "the engine had " + std::to_string(engine.cache().hits()) + " hits and " +
+               std::to_string(engine.cache().misses()) + " misses instead of one each";
+    }
+    if(rects[0] != rects[1])
+        return "the rectangles from the cache differ";
+    return "";
+}
+
+//    A result of the cleaner process has to come back unchanged.
+static std::string test_parts_hit(std::mt19937 &rng, const Layer &l)
+{
+    ResultCache cache;
+    std::vector<int> parts = random_parts(rng);
+    std::vector<int> value;
+    cache.put(slave_key(l),parts);
+    if(!cache.get(slave_key(l),value))
+        return "the parts were not found";
+    if(value != parts)
+        return "the parts from the cache differ";
+    return "";
+}
+
+//    With room for three results, the least recently used one is dropped when a fourth one is added.
+static std::string test_eviction(std::mt19937 &rng)
+{
+    size_t n = 100 + rng() % 100;
+    ResultCache cache(3 * n * sizeof(int));
+    std::vector<std::vector<int>> values;
+    std::vector<CacheKey> keys;
+    for(int i = 0; i < 4; i++)
+    {
+        values.push_back(random_value(rng,n));
+        keys.push_back(ResultCache::key(std::vector<int>{cache_rectangles,i},values[i].data(),values[i].size()));
+    }
+    std::vector<int> value;
+    for(int i = 0; i < 3; i++)
+        cache.put(keys[i],values[i]);
+    if(!cache.get(keys[0],value) || value != values[0])
+        return "the first result was not kept";
+    cache.put(keys[3],values[3]);
+    if(cache.get(keys[1],value))
+        return "the least recently used result was kept beyond the capacity";
+    for(int i: {0,2,3})
+    {
+        if(!cache.get(keys[i],value) || value != values[i])
+            return "result " + std::to_string(i) + " was dropped instead of the least recently used one";
+    }
+    cache.set_capacity(n * sizeof(int));
+    if(cache.get(keys[0],value) || cache.get(keys[2],value) || !cache.get(keys[3],value))
+        return "reducing the capacity did not keep only the most recently used result";
+    return "";
+}
+
+//    A result written by one cache has to be found by another one with the same directory, and files which are
+//    truncated or of another version have to be ignored.
+static std::string test_directory(std::mt19937 &rng, const Layer &l, const std::string &directory)
+{
+    CacheKey key = slave_key(l);
+    std::vector<int> parts = random_parts(rng);
+    {
+        ResultCache writer;
+        writer.set_directory(directory);
+        writer.put(key,parts);
+    }
+    std::vector<int> value;
+    {
+        ResultCache reader(0);
+        reader.set_directory(directory);
+        if(!reader.get(key,value))
+            return "the result was not found in the directory";
+        if(value != parts)
+            return "the result from the directory differs";
+    }
+
+    std::string name = file_name(directory,key);
+    std::FILE *f = std::fopen(name.data(),"rb");
+    if(!f)
+        return "the file of the result is missing";
+    std::vector<char> data;
+    for(int c; (c = std::fgetc(f)) != EOF; )
+        data.push_back(c);
+    std::fclose(f);
+
+    // The header starts with the magic and the version as uint32_t.
+    std::vector<std::vector<char>> broken(3,data);
+    broken[0].resize(data.size() - 1 - rng() % (data.size() - 1));
+    broken[1][4]++;
+    broken[2][0]++;
+    static const char *what[] = {"truncated","of another version","with another magic number"};
+    for(int i = 0; i < 3; i++)
+    {
+        f = std::fopen(name.data(),"wb");
+        std::fwrite(broken[i].data(),1,broken[i].size(),f);
+        std::fclose(f);
+        ResultCache reader(0);
+        reader.set_directory(directory);
+        if(reader.get(key,value))
+            return std::string("a file ") + what[i] + " was read";
+        if(reader.misses() != 1)
+            return std::string("a file ") + what[i] + " was not counted as a miss";
+    }
+    std::remove(name.data());
+    return "";
+}
+
+//    The keys of DrcEngine and of the cleaner process for the same layer have to differ, and a result stored by one of
+//    them must not be found by the other one in a shared directory.
+static std::string test_formats(std::mt19937 &rng, const Layer &l, const std::string &directory)
+{
+    CacheKey rectangles = engine_key(l,10);
+    CacheKey parts = slave_key(l);
+    if(rectangles == parts)
+        return "the keys of rectangles and parts are the same";
+    if(ResultCache::key(std::vector<int>{cache_rectangles},l.edges.data(),l.edges.size()) ==
+       ResultCache::key(std::vector<int>{cache_parts},l.edges.data(),l.edges.size()))
+    {
+        return "the format is not part of the key";
+    }
+
+    ResultCache engine;
+    engine.set_directory(directory);
+    engine.put(rectangles,random_value(rng,4 * (1 + rng() % 50)));
+    ResultCache slave;
+    slave.set_directory(directory);
+    std::vector<int> value;
+    if(slave.get(parts,value))
+        return "the parts were found in the rectangles of the same layer";
+    slave.put(parts,random_parts(rng));
+    if(!engine.get(rectangles,value) || !slave.get(parts,value))
+        return "the results of one format were replaced by those of the other one";
+    std::remove(file_name(directory,rectangles).data());
+    std::remove(file_name(directory,parts).data());
+    return "";
+}
+
+//    Runs all checks on the layer of seed. Returns an empty string or what is wrong.
+static std::string test_seed(unsigned seed, const std::string &directory)
+{
+    std::mt19937 rng(seed);
+    Layer l = random_layer(rng);
+    std::string error = test_engine_hit(l);
+    if(error.empty())
+        error = test_parts_hit(rng,l);
+    if(error.empty())
+        error = test_eviction(rng);
+    if(error.empty())
+        error = test_directory(rng,l,directory);
+    if(error.empty())
+        error = test_formats(rng,l,directory);
+    return error;
+}
+
+int main(int argc, char* argv[])
+{
+    int nseeds = argc > 1 ? std::atoi(argv[1]) : 100;
+    unsigned first = argc > 2 ? (unsigned)std::atoi(argv[2]) : 0;
+
+    char pattern[] = "/tmp/resultcache_test.XXXXXX";
+    if(!mkdtemp(pattern))
+    {
+        std::printf("resultcache_test: could not create a directory\n");
+        return 1;
+    }
+    std::string directory = pattern;
+
+    int failed = 0;
+    for(unsigned seed = first; seed < first + nseeds; seed++)
+    {
+        std::string error = test_seed(seed,directory);
+        if(!error.empty())
+        {
+            std::printf("seed %u: %s\n",seed,error.c_str());
+            failed++;
+        }
+    }
+    remove_directory(directory);
+    std::printf("resultcache_test: %d of %d seeds failed\n",failed,nseeds);
+    return failed ? 1 : 0;
+}
@@ -49,6 +49,7 @@ import traceback
 import subprocess
 import signal
 import multiprocessing
+import atexit
 
 from importlib.util import find_spec
 
@@ -93,7 +94,8 @@ if not sl_path:
                               stderr=subprocess.STDOUT, cwd=src_dir)
         p3 = subprocess.Popen(
             ('g++', cpp_path / 'source/CleanerMain.cpp', cpp_path / 'source/CleanerSlave.cpp',
-             cpp_path / 'source/DrcSl.cpp', cpp_path / 'source/SignalHandler.cpp', '-o', cpp_path / 'build/cleanermain',
+             cpp_path / 'source/DrcSl.cpp', cpp_path / 'source/ResultCache.cpp', cpp_path / 'source/SignalHandler.cpp',
+             '-o', cpp_path / 'build/cleanermain',
              '-isystem',
              '/usr/include/boost/', '-lboost_system', '-pthread', '-lboost_thread', '-lrt'), stdout=subprocess.PIPE,
             stderr=subprocess.STDOUT, cwd=src_dir)
@@ -121,9 +123,21 @@ if not sl_path:
 else:
     import kppc.drc.slcleaner
 
-if not can_multi:
+
+
+def in_process():
+    """
+    Whether multithreaded cleaning runs on the thread pool of :class:`PyDrcEngine <kppc.drc.slcleaner.PyDrcEngine>` in
+    this process instead of in the cleaner process.
+    """
+    return getattr(kppc.settings.Multithreading, 'InProcess', True)
+
+
+if not can_multi and not in_process():
     kppc.logger.info("Cannot use multiprocessing, falling back to single thread cleaning")
     kppc.settings.Multithreading.Enabled = False
+elif in_process():
+    kppc.logger.info("Using the in-process multithreaded cleaner")
 else:
     kppc.logger.info("Using the multiprocessing module")
     
@@ -131,6 +145,17 @@ if find_spec('kppc.drc.cleanermaster') and Path(cpp_path / 'build/cleanermain').
     import kppc.drc.cleanermaster
 
 
+def region_edges(reg: 'pya.Region'):
+    """
+    Collect the edges of all merged polygons of a region for the bulk ``add_edges`` of the cleaners.
+
+    :param reg: region to read the polygons from
+    :return: N x 4 int32 array with x1, x2, y1, y2 of each edge
+    """
+    return np.array([(edge.x1, edge.x2, edge.y1, edge.y2) for poly in reg.each_merged() for edge in poly.each_edge()],
+                    dtype=np.int32).reshape(-1, 4)
+
+
 def clean(cell: 'pya. Cell', cleanrules: list):
     """
     Clean a cell for width and space violations.
@@ -174,24 +199,16 @@ def clean(cell: 'pya. Cell', cleanrules: list):
         # feed the data into the cleaner
         reg = pya.Region(shapeit)
         reg.merge()
-        for poly in reg.each_merged():
-            for edge in poly.each_edge():
-                sl.add_data(edge.x1, edge.x2, edge.y1, edge.y2)
+        sl.add_edges(region_edges(reg))
         # Sort the edges in an ascending order. Also, removes touching edges or edges within other shapes.
         sl.sort()
         if violation_width != 1 and violation_space != 1:
             sl.clean()
-        # Create a region from the cleaned data. This is a bit slow. There might be a way to do it faster. The
-        # Region merge seems to be the most time consuming process.
+        # Create a region from the cleaned data. The rectangles of the cleaner do not overlap, so the region does not
+        # have to be merged.
         region_cleaned = pya.Region()
-        for row in range(bbox.p1.y, bbox.p2.y):
-            r = sl.get_row(row)
-            if r.size:
-                y1 = row
-                y2 = row + 1
-                for x1, x2 in zip(r[::2], r[1::2]):
-                    region_cleaned.insert(pya.Box(int(x1), int(y1), int(x2), int(y2)))
-        region_cleaned.merge()
+        for x1, y1, x2, y2 in sl.get_rectangles().tolist():
+            region_cleaned.insert(pya.Box(x1, y1, x2, y2))
 
         # Clean the target layer and fill in the cleaned data
         cell.clear(layer)
@@ -202,12 +219,282 @@ def clean(cell: 'pya. Cell', cleanrules: list):
         progress._destroy()
 
 
+def cache_settings():
+    """
+    Memory and directory of the cache of cleaned layers from the settings. The directory is created if it does not
+    exist yet.
+
+    :return: tuple of the memory in bytes and the directory, (0, '') if the cache is disabled
+    """
+    cache = getattr(kppc.settings, 'Cache', None) or kppc.default.Cache
+    if not cache.Enabled:
+        return 0, ''
+    directory = cache.Directory
+    if directory:
+        try:
+            directory = Path(directory).expanduser()
+            directory.mkdir(parents=True, exist_ok=True)
+            directory = str(directory)
+        except OSError as e:
+            kppc.logger.warning(f'Cannot use the cache directory {directory}: {e}')
+            directory = ''
+    return max(0, cache.Memory) << 20, directory
+
+
+def cache_stats():
+    """
+    Number of layers which were taken from the caches of the in-process engine and of the cleaner process, and of those
+    which had to be cleaned, since the engine and the process were started.
+
+    :return: dict with the keys ``'hits'`` and ``'misses'``
+    """
+    stats = {'hits': 0, 'misses': 0}
+    for source in (_engine, _daemon[0] if _daemon is not None else None):
+        if source is not None:
+            hits, misses = source.cache_stats()
+            stats['hits'] += hits
+            stats['misses'] += misses
+    return stats
+
+
+_engine = None
+
+
+def engine():
+    """
+    The in-process cleaning engine with the number of threads of the settings. The engine and its threads are kept for
+    the following cells and only replaced if the number of threads changes. Its cache is configured from the settings,
+    see :func:`cache_settings`.
+
+    :return: :class:`PyDrcEngine <kppc.drc.slcleaner.PyDrcEngine>`
+    """
+    global _engine
+    if kppc.settings.Multithreading.Automatic:
+        n = multiprocessing.cpu_count()
+    else:
+        n = max(1, kppc.settings.Multithreading.Threads)
+    if _engine is None or _engine.threads != n:
+        _engine = kppc.drc.slcleaner.PyDrcEngine(n)
+    _engine.set_cache(*cache_settings())
+    return _engine
+
+
+def add_hierarchical_layer(eng, cell: 'pya.Cell', layer: int, ln: int, ld: int, violation_width: int,
+                           violation_space: int):
+    """
+    Add a layer of a cell to an engine without flattening the instances of its child cells. Each child cell is added
+    once for every orientation it is placed in and the instances only refer to it, see
+    :meth:`PyDrcEngine.add_layer <kppc.drc.slcleaner.PyDrcEngine.add_layer>`. Instances with a magnification or an
+    angle which is not a multiple of 90 degrees are flattened into the shapes of the cell.
+
+    :param eng: :class:`PyDrcEngine <kppc.drc.slcleaner.PyDrcEngine>` to add the layer to
+    :param cell: cell of the layer
+    :param layer: layer index of the layer in the layout
+    :param ln: layer number
+    :param ld: datatype
+    :param violation_width: minimum width in database units
+    :param violation_space: minimum space in database units
+    """
+    layout = cell.layout()
+    bbox = cell.bbox_per_layer(layer)
+
+    def shapes(c: 'pya.Cell', max_depth: int = -1):
+        shapeit = c.begin_shapes_rec(layer)
+        shapeit.shape_flags = pya.Shapes.SPolygons | pya.Shapes.SBoxes
+        if max_depth >= 0:
+            shapeit.max_depth = max_depth
+        return pya.Region(shapeit)
+
+    own = shapes(cell, 0)
+    cells = {}
+    instances = []
+    for inst in cell.each_inst():
+        child = layout.cell(inst.cell_index)
+        child_box = child.bbox_per_layer(layer)
+        if child_box.empty():
+            continue
+        if inst.is_complex():
+            reg = shapes(child)
+            for t in inst.cell_inst.each_cplx_trans():
+                own += reg.transformed(t)
+            continue
+        for t in inst.cell_inst.each_trans():
+            key = (inst.cell_index, t.angle, t.is_mirror())
+            if key not in cells:
+                orientation = pya.Trans(t.angle, t.is_mirror(), 0, 0)
+                reg = shapes(child).transformed(orientation)
+                reg.merge()
+                box = child_box.transformed(orientation)
+                cells[key] = eng.add_cell(box.p1.x, box.p2.x, box.p1.y, box.p2.y, region_edges(reg))
+            instances.append((cells[key], t.disp.x, t.disp.y))
+
+    own.merge()
+    eng.add_layer(ln, ld, violation_width, violation_space, bbox.p1.x, bbox.p2.x, bbox.p1.y, bbox.p2.y,
+                  region_edges(own), np.array(instances, dtype=np.int32).reshape(-1, 3))
+
+
+def threaded_clean(cell: 'pya. Cell', cleanrules: list, hierarchical: bool = None):
+    """
+    Clean a cell for width and space violations.
+    This function will clear the output layers of any shapes and insert a cleaned region.
+    All layers are cleaned at once on the threads of :func:`engine` in this process, which avoids starting the cleaner
+    process and copying the layers into shared memory.
+
+    :param cell: pointer to the cell that needs to be cleaned
+    :param cleanrules: list with the layerpurposepairs, violationwidths and violationspaces in the form [[[layer,
+        purpose], violationwidth, violationspace], [[layer2, purpose2], violationwidth2, violationspace2], ...]
+    :param hierarchical: clean each child cell only once for all of its instances, see
+        :func:`add_hierarchical_layer`. The result is inserted flat into the cell all the same. The setting
+        Multithreading.Hierarchical is used if None.
+    """
+    if hierarchical is None:
+        hierarchical = getattr(kppc.settings.Multithreading, 'Hierarchical', False)
+
+    eng = engine()
+    eng.clear()
+
+    if kppc.settings.General.Progressbar:
+        progress = pya.RelativeProgress('Preparing Output Layers', len(cleanrules))
+
+    try:
+        for cr in cleanrules:
+
+            # split the rules into their parts
+            layer_spec, violation_width, violation_space = cr
+            ln, ld = layer_spec
+
+            if ln is None:
+                continue
+
+            layer = cell.layout().layer(ln, ld)
+
+            if kppc.settings.General.Progressbar:
+                progress.format = 'Layer {}/{}'.format(ln, ld)
+                progress.inc()
+
+            bbox = cell.bbox_per_layer(layer)
+            if bbox.empty():
+                continue
+
+            if hierarchical:
+                add_hierarchical_layer(eng, cell, layer, ln, ld, violation_width, violation_space)
+                continue
+
+            # Retrieve the recursive
+            shapeit = cell.begin_shapes_rec(layer)
+            shapeit.shape_flags = pya.Shapes.SPolygons | pya.Shapes.SBoxes
+
+            reg = pya.Region(shapeit)
+            reg.merge()
+            eng.add_layer(ln, ld, violation_width, violation_space, bbox.p1.x, bbox.p2.x, bbox.p1.y, bbox.p2.y,
+                          region_edges(reg))
+
+        if kppc.settings.General.Progressbar:
+            progress._destroy()
+            progress = pya.RelativeProgress('Cleaning Design Rule Violations', len(eng))
+            progress.format = 'Cleaning {} Layers'.format(len(eng))
+
+        eng.run()
+
+        for i in range(len(eng)):
+            ln, ld = eng.get_layer(i)
+            layer = cell.layout().layer(ln, ld)
+
+            # The rectangles of the cleaner do not overlap, so the region does not have to be merged.
+            region_cleaned = pya.Region()
+            for x1, y1, x2, y2 in eng.get_rectangles(i).tolist():
+                region_cleaned.insert(pya.Box(x1, y1, x2, y2))
+
+            # Clean the target layer and fill in the cleaned data
+            cell.clear(layer)
+            cell.shapes(layer).insert(region_cleaned)
+            if kppc.settings.General.Progressbar:
+                progress.inc()
+    finally:
+        eng.clear()
+        if kppc.settings.General.Progressbar:
+            progress._destroy()
+
+
+_daemon = None
+
+
+def cleaner_threads():
+    """
+    Number of threads for the cleaner process from the settings.
+    """
+    if kppc.settings.Multithreading.Automatic:
+        return multiprocessing.cpu_count()
+    n = kppc.settings.Multithreading.Threads
+    if n < 1:
+        n = 1
+    elif n > multiprocessing.cpu_count():
+        kppc.logger.warning(f'Trying to intialize with {n} threads. The hardware only supports {multiprocessing.cpu_count()} threads. Settings to hardware maximum')
+        n = multiprocessing.cpu_count()
+        kppc.settings.Multithreading._Threads_MAX = n
+    return n
+
+
+def cleaner_daemon():
+    """
+    The cleaner process and its engine, which are kept running for the following cells. A new process is only started
+    if there is none yet, if it stopped responding or if the number of threads or the cache settings changed. It is shut
+    down when KLayout exits.
+
+    :return: :class:`PyCleanerMaster <kppc.drc.cleanermaster.PyCleanerMaster>` of the running cleaner process
+    """
+    global _daemon
+    n = cleaner_threads()
+    memory, directory = cache_settings()
+    config = (n, memory, directory)
+    if _daemon is not None:
+        cm, cs, running_config = _daemon
+        if running_config == config and cs.poll() is None and cm.alive(2000):
+            return cm
+        kppc.logger.info('Restarting the cleaner process')
+        stop_cleaner_daemon()
+
+    kppc.logger.info(f'Starting the cleaner process with {n} threads')
+    # The engine gets a name of its own, so other sessions can clean at the same time. The output of the process is
+    # discarded, a pipe which is never read would block it eventually.
+    cm = kppc.drc.cleanermaster.PyCleanerMaster()
+    cs = subprocess.Popen([cpp_path / 'build/cleanermain', str(n), cm.name, str(memory >> 20), directory],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    if not cm.wait_ready(5000):
+        cs.kill()
+        cs.wait()
+        raise RuntimeError('The cleaner process did not start')
+    _daemon = (cm, cs, config)
+    return cm
+
+
+def stop_cleaner_daemon():
+    """
+    Shut the cleaner process down, if it is running.
+    """
+    global _daemon
+    if _daemon is None:
+        return
+    cm, cs, config = _daemon
+    _daemon = None
+    cm.shutdown()
+    try:
+        cs.wait(5)
+    except subprocess.TimeoutExpired:
+        cs.kill()
+        cs.wait()
+
+
+atexit.register(stop_cleaner_daemon)
+
+
 def multiprocessing_clean(cell: 'pya. Cell', cleanrules: list):
     """
     Clean a cell for width and space violations.
     This function will clear the output layers of any shapes and insert a cleaned region.
     Does the cleaning in a seperate Process started as a childprocess,
-    which will calculate in parallel with multiple threads.
+    which will calculate in parallel with multiple threads. The process is kept running for the following cells, see
+    :func:`cleaner_daemon`.
 
     :param cell: pointer to the cell that needs to be cleaned
     :param cleanrules: list with the layerpurposepairs, violationwidths and violationspaces in the form [[[layer,
@@ -215,23 +502,7 @@ def multiprocessing_clean(cell: 'pya. Cell', cleanrules: list):
     """
     t = time.time()
 
-    cm = kppc.drc.cleanermaster.PyCleanerMaster()
-    if kppc.settings.Multithreading.Automatic:
-        kppc.logger.info("Automatic Multithreading")
-        cs = subprocess.Popen([cpp_path / 'build/cleanermain', ],
-                              stdout=subprocess.PIPE,stderr=subprocess.STDOUT)
-    else:
-        n = kppc.settings.Multithreading.Threads
-        if n < 1:
-            n = 1
-        elif n > multiprocessing.cpu_count():
-            kppc.logger.warning(f'Trying to intialize with {n} threads. The hardware only supports {multiprocessing.cpu_count()} threads. Settings to hardware maximum')
-            n = multiprocessing.cpu_count()
-            kppc.settings.Multithreading._Threads_MAX = n
-        kppc.logger.info(f'Multithreading with {n} Threads')
-        cs = subprocess.Popen([cpp_path / 'build/cleanermain', str(n), ],
-                              stdout=subprocess.PIPE,
-                              stderr=subprocess.STDOUT)
+    cm = cleaner_daemon()
 
     if kppc.settings.General.Progressbar:
         processedlayers = {}
@@ -279,11 +550,10 @@ def multiprocessing_clean(cell: 'pya. Cell', cleanrules: list):
                 # Feed the data into the cleaner
                 reg = pya.Region(shapeit)
                 reg.merge()
-                for poly in reg.each_merged():
-                    for edge in poly.each_edge():
-                        cm.add_edge(edge.x1, edge.x2, edge.y1, edge.y2)
-                while cm.done():
-                    time.sleep(.1)
+                cm.add_edges(region_edges(reg))
+                while cm.done(100):
+                    if not cm.alive(2000):
+                        raise RuntimeError('The cleaner process stopped responding')
 
                 count += 1
 
@@ -298,41 +568,52 @@ def multiprocessing_clean(cell: 'pya. Cell', cleanrules: list):
             progress.format = 'Cleaned Violations in {} of {} Layers. Next expected layer: {}'.format(0, count, next(
                 (x for x in processedlayers.keys() if not processedlayers[x]), None))
 
-        for i in range(count):
-            while True:
-                polygons = cm.polygons()
-                waiting = np.all(polygons[0][0] == (-1, -1))
-                if waiting:
-                    time.sleep(1)
-                    continue
-                else:
-                    ln, ld = polygons[0][0][0], polygons[0][0][1]
-                    layer = cell.layout().layer(ln, ld)
-                    bbox = cell.bbox_per_layer(layer)
-
-                    region_cleaned = pya.Region()
-                    for p in polygons[1:]:
-                        region_cleaned.insert(pya.Polygon([pya.Point(x[0], x[1]) for x in p]))
-                    region_cleaned.merge()
-
-                    # Clean the target layer and fill in the cleaned data
+        # Large layers arrive in several parts, which are inserted as they arrive while the cleaner process still
+        # works on the others. Parts of different layers may arrive mixed.
+        parts_left = {}
+        finished = 0
+        while finished < count:
+            result = cm.result(1000)
+            if result is None:
+                if not cm.alive(2000):
+                    raise RuntimeError('The cleaner process stopped responding')
+                continue
+            with result:
+                ln, ld = result.layer, result.datatype
+                layer = cell.layout().layer(ln, ld)
+
+                # The arrays map the shared memory, they are converted to lists once. The polygons of the cleaner
+                # do not overlap, not even across the parts, so the region does not have to be merged.
+                offsets = result.offsets.tolist()
+                points = result.points.tolist()
+                region_cleaned = pya.Region()
+                for j in range(len(offsets) - 1):
+                    region_cleaned.insert(pya.Polygon([pya.Point(x, y) for x, y in points[offsets[j]:offsets[j + 1]]]))
+
+                # Clean the target layer with the first part and fill in the cleaned data
+                if (ln, ld) not in parts_left:
+                    parts_left[(ln, ld)] = result.nparts
                     cell.clear(layer)
-                    cell.shapes(layer).insert(region_cleaned)
-                    if kppc.settings.General.Progressbar:
-                        processedlayers['{}/{}'.format(ln, ld)] = True
-                        text = 'Cleaned Violations in {} of {} Layers. Next expected layer: {}'
-                        text = text.format(i + 1, count,
-                                           next((x for x in processedlayers.keys() if not processedlayers[x]), None))
-                        progress.format = text
-                        progress.inc()
-                    break
+                parts_left[(ln, ld)] -= 1
+            cell.shapes(layer).insert(region_cleaned)
+            if parts_left[(ln, ld)]:
+                continue
+
+            finished += 1
+            if kppc.settings.General.Progressbar:
+                processedlayers['{}/{}'.format(ln, ld)] = True
+                text = 'Cleaned Violations in {} of {} Layers. Next expected layer: {}'
+                text = text.format(finished, count,
+                                   next((x for x in processedlayers.keys() if not processedlayers[x]), None))
+                progress.format = text
+                progress.inc()
 
     except Exception as e:
         kppc.logger.error(e)
         traceback.print_exc(file=sys.stdout)
+        # Layers of this cell may still be queued or cleaned, the next cell starts with a fresh process instead.
+        stop_cleaner_daemon()
     finally:
         kppc.logger.debug("Done. Time passed: {}".format(time.time() - t))
-        cs.send_signal(signal.SIGUSR1)
-        cs.wait()
         if kppc.settings.General.Progressbar:
             progress._destroy()
@@ -767,7 +767,10 @@ class PhotDevice(pya.PCellDeclarationHelper):
                         for cr in rules:
                             cr[1] = int(cr[1] / self.layout.dbu)
                             cr[2] = int(cr[2] / self.layout.dbu)
-                        kppc.drc.multiprocessing_clean(prep_cell, rules)
+                        if kppc.drc.in_process():
+                            kppc.drc.threaded_clean(prep_cell, rules)
+                        else:
+                            kppc.drc.multiprocessing_clean(prep_cell, rules)
 
             else:
                 # the dataprep will clean all children and shapes and then insert cleaned ones
@@ -783,7 +786,10 @@ class PhotDevice(pya.PCellDeclarationHelper):
                         for cr in rules:
                             cr[1] = int(cr[1] / self.layout.dbu)
                             cr[2] = int(cr[2] / self.layout.dbu)
-                        kppc.drc.multiprocessing_clean(temp_cell, rules)
+                        if kppc.drc.in_process():
+                            kppc.drc.threaded_clean(temp_cell, rules)
+                        else:
+                            kppc.drc.multiprocessing_clean(temp_cell, rules)
                     # felete all child cells
                     self.cell.clear()
                     self.cell.insert(pya.CellInstArray(temp_cell.cell_index(), pya.Trans.R0))
@@ -0,0 +1,22 @@
+#!/bin/bash
+
+#Script that compiles the benchmarks of the C++ cleaner into cpp/build and runs the one given as first argument
+#./benchmark.sh drcsl [options] runs the benchmark of the phases of DrcSl, see drcsl_bench --help for the options
+#./benchmark.sh ipc [options] runs the benchmark of the cleaner process against cpp/build/cleanermain, which compile.sh
+#builds, see ipc_bench --help for the options
+cd "$(dirname "$0")"/../cpp/source
+mkdir -p ../build
+
+g++ -O2 -std=c++14 -I. ../benchmark/DrcSlBench.cpp DrcSl.cpp -o ../build/drcsl_bench -pthread || exit 1
+g++ -O2 -std=c++14 -I. ../benchmark/IpcBench.cpp CleanerMaster.cpp -o ../build/ipc_bench -isystem /usr/include/boost/ -lboost_system -pthread -lboost_thread -lrt || exit 1
+
+case "$1" in
+    drcsl)
+        shift
+        ../build/drcsl_bench "$@"
+        ;;
+    ipc)
+        shift
+        ../build/ipc_bench "$@"
+        ;;
+esac
@@ -10,7 +10,7 @@ DRCDIR="../../python/kppc/drc/"
 
 python3 setup.py build_ext -b $DRCDIR &
 python3 setup_cc.py build_ext -b $DRCDIR &
-g++ CleanerMain.cpp CleanerSlave.cpp DrcSl.cpp SignalHandler.cpp -o ../build/cleanermain -isystem /usr/include/boost/ -lboost_system -pthread -lboost_thread -lrt
+g++ CleanerMain.cpp CleanerSlave.cpp DrcSl.cpp ResultCache.cpp SignalHandler.cpp -o ../build/cleanermain -isystem /usr/include/boost/ -lboost_system -pthread -lboost_thread -lrt
 
 #/usr/bin/python3 setup.py build_ext -b ./
 #cp slcleaner.cpython* ../
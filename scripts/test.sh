@@ -0,0 +1,16 @@
+#!/bin/bash
+
+#Script that compiles the tests of the C++ cleaner into cpp/build and runs them, run it after compile.sh
+#Each test cleans seeded random layouts, see the top of its source in cpp/test for its arguments
+cd "$(dirname "$0")"/../cpp/source
+mkdir -p ../build
+
+g++ -O2 -std=c++14 -I. ../test/DrcSlTest.cpp DrcSl.cpp -o ../build/drcsl_test -pthread || exit 1
+g++ -O2 -std=c++14 -I. ../test/DrcEngineTest.cpp DrcEngine.cpp ResultCache.cpp DrcSl.cpp -o ../build/drcengine_test \
+    -pthread || exit 1
+g++ -O2 -std=c++14 -I. ../test/ResultCacheTest.cpp DrcEngine.cpp ResultCache.cpp DrcSl.cpp -o ../build/resultcache_test \
+    -pthread || exit 1
+
+../build/drcsl_test || exit 1
+../build/drcengine_test || exit 1
+../build/resultcache_test || exit 1